@@ -0,0 +1,56 @@
+#ifndef AABB_H
+#define AABB_H
+#include <algorithm>
+
+#include "vec3.h"
+
+// Axis-aligned bounding box. Default constructed boxes are empty, so that
+// growing one by a point or a box yields exactly that point or box.
+struct Aabb {
+  Point min_ = Point(INF, INF, INF);
+  Point max_ = Point(-INF, -INF, -INF);
+
+  Aabb() = default;
+  Aabb(Point const& min, Point const& max) : min_(min), max_(max) {}
+
+  bool empty() const { return min_.x() > max_.x(); }
+  Point center() const { return 0.5 * (min_ + max_); }
+  Direction diagonal() const { return max_ - min_; }
+
+  // Index of the longest axis.
+  int maxExtent() const {
+    Direction d = diagonal();
+    if (d.x() > d.y() && d.x() > d.z()) return 0;
+    return d.y() > d.z() ? 1 : 2;
+  }
+
+  void grow(Point const& p) {
+    min_ = Point(std::min(min_.x(), p.x()), std::min(min_.y(), p.y()),
+                 std::min(min_.z(), p.z()));
+    max_ = Point(std::max(max_.x(), p.x()), std::max(max_.y(), p.y()),
+                 std::max(max_.z(), p.z()));
+  }
+  void grow(Aabb const& box) {
+    if (box.empty()) return;
+    grow(box.min_);
+    grow(box.max_);
+  }
+
+  bool contains(Point const& p) const {
+    return p.x() >= min_.x() && p.x() <= max_.x() && p.y() >= min_.y() &&
+           p.y() <= max_.y() && p.z() >= min_.z() && p.z() <= max_.z();
+  }
+
+  double distanceSquared(Point const& p) const {
+    double dx = std::max({0.0, min_.x() - p.x(), p.x() - max_.x()});
+    double dy = std::max({0.0, min_.y() - p.y(), p.y() - max_.y()});
+    double dz = std::max({0.0, min_.z() - p.z(), p.z() - max_.z()});
+    return dx * dx + dy * dy + dz * dz;
+  }
+};
+
+static double axis(Point const& p, int dim) {
+  return dim == 0 ? p.x() : (dim == 1 ? p.y() : p.z());
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "aov.h"
+#include "camera.h"
+#include "film.h"
+#include "parallel.h"
+#include "world.h"
+
+// Path tracing with the SAMPLE_RATE ^ 2 samples per pixel budget spent where
+// the noise is. Every pixel first takes adaptive_batch samples; then, in
+// rounds, every pixel whose relative error (Film::relativeError) is still
+// above target_error takes another batch, the noisiest first when the
+// budget runs short, until none is left above it or the budget is spent.
+// Each row of each round draws from its own stream, seeded by the round, as
+// ProgressiveRenderer's rows are by the pass, so renders are repeatable.
+struct AdaptiveSampling {
+  // Render into film, recording the AOVs of aovs unless it is null, and
+  // store each pixel's sample count into counts.
+  static void render(Camera const& camera, Film& film, AovFramebuffer* aovs,
+                     std::vector<int>& counts) {
+    Options const& options = Options::get();
+    int batch = std::max(2, options.adaptive_batch);
+    long long budget =
+        static_cast<long long>(SAMPLE_RATE) * SAMPLE_RATE * IMAGE_W * IMAGE_H;
+    std::vector<int> active(IMAGE_W * IMAGE_H);
+    for (int i = 0; i < IMAGE_W * IMAGE_H; i++) active[i] = i;
+    int rounds = 0;
+    while (!active.empty() && budget >= batch) {
+      long long affordable = budget / batch;
+      if (static_cast<long long>(active.size()) > affordable) {
+        std::partial_sort(active.begin(), active.begin() + affordable,
+                          active.end(), [&](int a, int b) {
+                            return error(film, a) > error(film, b);
+                          });
+        active.resize(affordable);
+        std::sort(active.begin(), active.end());
+      }
+      // Rows of active pixels, so each row's pixels stay on one thread.
+      std::vector<size_t> row_start(IMAGE_H + 1);
+      for (int h = 0, i = 0; h <= IMAGE_H; h++) {
+        while (i < static_cast<int>(active.size()) &&
+               active[i] / IMAGE_W < h) {
+          i++;
+        }
+        row_start[h] = i;
+      }
+      parallelRows(IMAGE_H, [&](int h) {
+        StreamSource source(static_cast<uint64_t>(rounds) * IMAGE_H + h);
+        random_source = &source;
+        AovSample sample;
+        if (aovs) World::setAovSample(&sample);
+        for (size_t i = row_start[h]; i < row_start[h + 1]; i++) {
+          int w = active[i] % IMAGE_W;
+          for (int s = 0; s < batch; s++) {
+            if (!aovs) {
+              film.add(h, w, samplePixel(camera, h, w));
+              continue;
+            }
+            sample = AovSample();
+            Color color = samplePixel(camera, h, w);
+            film.add(h, w, color);
+            aovs->add(h, w, sample, color);
+          }
+        }
+        random_source = nullptr;
+        World::setAovSample(nullptr);
+      });
+      budget -= static_cast<long long>(active.size()) * batch;
+      rounds++;
+      std::cerr << "round " << rounds << ": " << active.size()
+                << " pixels" << std::endl;
+      active.erase(std::remove_if(active.begin(), active.end(),
+                                  [&](int i) {
+                                    return error(film, i) <=
+                                           options.target_error;
+                                  }),
+                   active.end());
+    }
+
+    counts.assign(IMAGE_W * IMAGE_H, 0);
+    long long total = 0;
+    int most = 0;
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        counts[h * IMAGE_W + w] = film.samples(h, w);
+        total += film.samples(h, w);
+        most = std::max(most, film.samples(h, w));
+      }
+    }
+    std::cerr << "adaptive sampling: " << rounds << " rounds, "
+              << static_cast<double>(total) / (IMAGE_W * IMAGE_H)
+              << " spp on average, at most " << most << ", "
+              << active.size() << " pixels above the target error"
+              << std::endl;
+  }
+
+  // counts as an image, brightness proportional to the sample count.
+  static void countImage(std::vector<int> const& counts, Image& image) {
+    float most = std::max(1, *std::max_element(counts.begin(), counts.end()));
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        // Squared to undo the gamma of ImagePrinter.
+        float value = counts[h * IMAGE_W + w] / most;
+        image[h][w] = Color(1, 1, 1) * (value * value);
+      }
+    }
+  }
+
+ private:
+  static double error(Film const& film, int i) {
+    return film.relativeError(i / IMAGE_W, i % IMAGE_W);
+  }
+
+  // A path through a uniform point of the pixel's footprint, the box two
+  // pixels wide that renderPaths samples, clipped to the image.
+  static Color samplePixel(Camera const& camera, int h, int w) {
+    double dx = (w + offset(w, IMAGE_W)) / (IMAGE_W - 1);
+    double dy = (h + offset(h, IMAGE_H)) / (IMAGE_H - 1);
+    return World::traceRay(camera.emitRay(dx, dy, camera.sampleLens()), 0);
+  }
+  static double offset(int i, int size) {
+    return rand_double(i == 0 ? 0.0 : -1.0, i == size - 1 ? 0.0 : 1.0);
+  }
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+#include <algorithm>
+#include <vector>
+
+#include "utility.h"
+
+// Walker's alias method: sample an index in proportion to its weight in O(1)
+// after an O(n) build.
+class AliasTable {
+ public:
+  AliasTable() = default;
+  explicit AliasTable(std::vector<double> const& weights) { build(weights); }
+
+  void build(std::vector<double> const& weights) {
+    size_t n = weights.size();
+    bins_.assign(n, Bin());
+    double total = 0.0;
+    for (double weight : weights) total += weight;
+    if (n == 0 || total <= 0.0) return;
+
+    // Vose's variant: pair each underfull bin with an overfull one.
+    std::vector<size_t> under, over;
+    std::vector<double> scaled(n);
+    for (size_t i = 0; i < n; i++) {
+      bins_[i].pmf_ = weights[i] / total;
+      scaled[i] = bins_[i].pmf_ * n;
+      (scaled[i] < 1.0 ? under : over).push_back(i);
+    }
+    while (!under.empty() && !over.empty()) {
+      size_t small = under.back(), large = over.back();
+      under.pop_back();
+      bins_[small].threshold_ = scaled[small];
+      bins_[small].alias_ = large;
+      scaled[large] -= 1.0 - scaled[small];
+      if (scaled[large] < 1.0) {
+        over.pop_back();
+        under.push_back(large);
+      }
+    }
+    // Leftovers are full up to rounding error.
+    for (size_t i : under) bins_[i].threshold_ = 1.0;
+    for (size_t i : over) bins_[i].threshold_ = 1.0;
+  }
+
+  bool empty() const { return bins_.empty(); }
+  size_t size() const { return bins_.size(); }
+  double pmf(size_t index) const { return bins_[index].pmf_; }
+
+  size_t sample(double u, double* pmf = nullptr) const {
+    double scaled = u * bins_.size();
+    size_t index = std::min(static_cast<size_t>(scaled), bins_.size() - 1);
+    if (scaled - index >= bins_[index].threshold_) {
+      index = bins_[index].alias_;
+    }
+    if (pmf) *pmf = bins_[index].pmf_;
+    return index;
+  }
+
+ private:
+  struct Bin {
+    double threshold_ = 1.0;
+    double pmf_ = 0.0;
+    size_t alias_ = 0;
+  };
+  std::vector<Bin> bins_;
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef AOV_H
+#define AOV_H
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+
+// Arbitrary output variables: per-pixel quantities a camera path records
+// alongside its radiance, for compositing and denoising. Flags, combined
+// into a mask.
+enum Aov : unsigned {
+  // The first surface's normal, albedo, distance from the lens and
+  // Material::id, which is -1 where the path hits nothing.
+  AOV_NORMAL = 1,
+  AOV_ALBEDO = 2,
+  AOV_DEPTH = 4,
+  AOV_MATERIAL_ID = 8,
+  // Light that left an emitter at most one bounce after the camera, and the
+  // rest, which add up to the radiance.
+  AOV_DIRECT = 16,
+  AOV_INDIRECT = 32,
+};
+
+// The AOVs' names, in the order of their flags, which are also the files
+// AovFramebuffer::write writes them to.
+static char const* const AOV_NAMES[] = {"normal",      "albedo", "depth",
+                                        "material_id", "direct", "indirect"};
+
+// What World::traceRay records for a camera path while one is set with
+// World::setAovSample. A miss leaves the first-hit fields as they are.
+struct AovSample {
+  Direction normal_ = Direction(0, 0, 0);
+  Color albedo_ = Color(0, 0, 0);
+  double depth_ = 0.0;
+  int material_id_ = -1;
+  // The direct part of what the last traceRay call at depth 0 or 1
+  // returned; at depth 0, of the path's radiance.
+  Color direct_ = Color(0, 0, 0);
+};
+
+// The mask for a comma separated list of AOV names, or "all".
+inline unsigned parseAovs(std::string const& names) {
+  unsigned mask = 0;
+  std::stringstream stream(names);
+  std::string name;
+  while (std::getline(stream, name, ',')) {
+    if (name.empty()) continue;
+    if (name == "all") {
+      mask = (1u << 6) - 1;
+      continue;
+    }
+    int i = 0;
+    while (i < 6 && name != AOV_NAMES[i]) i++;
+    if (i == 6) {
+      std::cerr << "Unknown AOV " << name << std::endl;
+    } else {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+
+// A multi-channel framebuffer of the AOVs in a mask: per pixel, the running
+// sums of each one's samples, interleaved, and the sample count. The
+// material id is the first sample's, since ids don't average. As with Film,
+// each pixel must only be added to by one thread at a time.
+class AovFramebuffer {
+ public:
+  AovFramebuffer(int width, int height, unsigned aovs)
+      : width_(width), height_(height), aovs_(aovs) {
+    static int const WIDTHS[] = {3, 3, 1, 1, 3, 3};
+    for (int i = 0; i < 6; i++) {
+      offsets_[i] = aovs & (1u << i) ? stride_ : -1;
+      if (aovs & (1u << i)) stride_ += WIDTHS[i];
+    }
+    stride_++;
+    channels_.assign(static_cast<size_t>(width) * height * stride_, 0.0f);
+  }
+
+  unsigned aovs() const { return aovs_; }
+
+  void add(int h, int w, AovSample const& sample, Color const& radiance) {
+    float* pixel =
+        &channels_[(static_cast<size_t>(h) * width_ + w) * stride_];
+    if (aovs_ & AOV_NORMAL) accumulate(pixel, AOV_NORMAL, sample.normal_);
+    if (aovs_ & AOV_ALBEDO) accumulate(pixel, AOV_ALBEDO, sample.albedo_);
+    if (aovs_ & AOV_DEPTH) pixel[offset(AOV_DEPTH)] += sample.depth_;
+    if ((aovs_ & AOV_MATERIAL_ID) && pixel[stride_ - 1] == 0.0f) {
+      pixel[offset(AOV_MATERIAL_ID)] = sample.material_id_;
+    }
+    if (aovs_ & AOV_DIRECT) accumulate(pixel, AOV_DIRECT, sample.direct_);
+    if (aovs_ & AOV_INDIRECT) {
+      accumulate(pixel, AOV_INDIRECT, radiance - sample.direct_);
+    }
+    pixel[stride_ - 1] += 1.0f;
+  }
+
+  // The mean of one of the AOVs in the mask at a pixel, in all three
+  // channels for the scalar ones.
+  Color mean(int h, int w, Aov aov) const {
+    float const* pixel =
+        &channels_[(static_cast<size_t>(h) * width_ + w) * stride_];
+    float const* value = pixel + offset(aov);
+    if (aov == AOV_MATERIAL_ID) return Color(*value, *value, *value);
+    float samples = std::max(1.0f, pixel[stride_ - 1]);
+    if (aov == AOV_DEPTH) {
+      return Color(*value, *value, *value) / samples;
+    }
+    return Color(value[0], value[1], value[2]) / samples;
+  }
+
+  // Write each AOV in the mask, or in both it and aovs, to <name>.pfm, a
+  // floating point image, three channels for the colors and vectors and one
+  // for depth and material id.
+  void write(unsigned aovs = ~0u) const {
+    for (int i = 0; i < 6; i++) {
+      if (aovs_ & aovs & (1u << i)) {
+        writePfm(std::string(AOV_NAMES[i]) + ".pfm",
+                 static_cast<Aov>(1u << i));
+      }
+    }
+  }
+
+  // The sums in binary, for checkpoints, and read back into a framebuffer
+  // of the same size and AOVs. read returns false if the input is too short.
+  void write(std::ostream& out) const {
+    out.write(reinterpret_cast<char const*>(channels_.data()),
+              channels_.size() * sizeof(float));
+  }
+  bool read(std::istream& in) {
+    in.read(reinterpret_cast<char*>(channels_.data()),
+            channels_.size() * sizeof(float));
+    return static_cast<bool>(in);
+  }
+
+ private:
+  int offset(Aov aov) const {
+    int i = 0;
+    while ((1u << i) != aov) i++;
+    return offsets_[i];
+  }
+
+  template <typename T>
+  void accumulate(float* pixel, Aov aov, Vec3<T> const& value) {
+    float* channel = pixel + offset(aov);
+    channel[0] += value.x();
+    channel[1] += value.y();
+    channel[2] += value.z();
+  }
+
+  // Rows bottom to top, little-endian, as PFM has them; written to a
+  // temporary file renamed over filename, like ImagePrinter::printPpm.
+  void writePfm(std::string const& filename, Aov aov) const {
+    bool gray = aov == AOV_DEPTH || aov == AOV_MATERIAL_ID;
+    std::string temporary = filename + ".tmp";
+    std::ofstream file(temporary, std::ios::binary);
+    file << (gray ? "Pf\n" : "PF\n") << width_ << ' ' << height_
+         << "\n-1.0\n";
+    std::vector<float> row;
+    for (int h = 0; h < height_; h++) {
+      row.clear();
+      for (int w = 0; w < width_; w++) {
+        Color value = mean(h, w, aov);
+        row.push_back(value.x());
+        if (!gray) {
+          row.push_back(value.y());
+          row.push_back(value.z());
+        }
+      }
+      file.write(reinterpret_cast<char const*>(row.data()),
+                 row.size() * sizeof(float));
+    }
+    file.close();
+    std::rename(temporary.c_str(), filename.c_str());
+  }
+
+  int width_, height_;
+  unsigned aovs_;
+  // Where each AOV starts within a pixel, -1 if not in the mask, and the
+  // floats per pixel, the last of them the sample count.
+  int offsets_[6];
+  int stride_ = 0;
+  std::vector<float> channels_;
+};
+
+#endif
@@ -1,13 +1,27 @@
 #ifndef BACKGROUND_H
 #define BACKGROUND_H
+#include "environment.h"
 #include "ray.h"
 
 struct Background {
   static Color color(Ray const& ray) {
+    if (map) return map->radiance(ray.direction().normalize());
     static const Color white(1.0, 1.0, 1.0), blue(0.5, 0.7, 1.0);
     float blend_factor = (ray.direction().normalize().y() + 1.0) * 0.5;
     return ((1.0f - blend_factor) * white + blend_factor * blue) * 0.005f;
   }
+
+  // Light the scene by map instead of the dim sky gradient, sampled
+  // directly at diffuse and fog vertices. Pass null for the gradient.
+  static void setEnvironment(EnvironmentMap const* environment) {
+    map = environment;
+  }
+  static EnvironmentMap const* environment() { return map; }
+
+ private:
+  static EnvironmentMap const* map;
 };
 
-#endif
\ No newline at end of file
+EnvironmentMap const* Background::map = nullptr;
+
+#endif
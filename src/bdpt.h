@@ -0,0 +1,545 @@
+#ifndef BDPT_H
+#define BDPT_H
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "camera.h"
+#include "film.h"
+#include "parallel.h"
+#include "world.h"
+
+// A vertex of a camera or light subpath. Densities are per unit area for
+// vertices on surfaces and per unit volume for vertices in the fog.
+struct PathVertex {
+  enum Type { CAMERA, LIGHT, SURFACE, FOG };
+  Type type_;
+  Point p_;
+  // Outward normal of the sphere, or the lens normal for the camera.
+  Direction normal_;
+  // The hit that made a SURFACE vertex.
+  HitRecord hit_record_;
+  // Index in World::emitters() of a LIGHT vertex.
+  size_t light_ = 0;
+  // Path throughput up to and including this vertex.
+  Color beta_;
+  // Scattering here picks a single direction.
+  bool delta_ = false;
+  // Density of generating this vertex from the subpath's previous vertex,
+  // and from the next one when the path is traced the other way.
+  double pdf_fwd_ = 0.0;
+  double pdf_rev_ = 0.0;
+
+  bool emissive() const {
+    return type_ == LIGHT ||
+           (type_ == SURFACE && hit_record_.material_->isEmissive());
+  }
+};
+
+// Bidirectional path tracing (Veach and Guibas; structured after pbrt-v3).
+// Every pass traces one camera subpath and one light subpath per pixel and
+// connects every pair of their vertices, weighting each connection strategy
+// with the balance heuristic. Connections straight to the lens land on
+// arbitrary pixels and are splatted into a SplatBuffer.
+//
+// The fog only fills the space between the spheres: a segment ends in the
+// fog with density fogDensity(d) of its length d, and only if the ray,
+// traced from the camera side, would hit something. Light subpaths sample
+// the same distances, and their throughput carries the ratio between the
+// camera-side and light-side densities of each segment.
+class Bdpt {
+ public:
+  explicit Bdpt(Camera const& camera)
+      : camera_(camera),
+        max_depth_(Options::get().bdpt_max_depth),
+        splats_(IMAGE_W, IMAGE_H) {}
+
+  void render(Image& image) {
+    int spp = Options::get().bdpt_spp;
+    std::vector<Color> sum(IMAGE_W * IMAGE_H);
+    for (int pass = 0; pass < spp; pass++) {
+      parallelRows(IMAGE_H, [&](int h) {
+        std::vector<PathVertex> camera_path, light_path;
+        for (int w = 0; w < IMAGE_W; w++) {
+          sum[h * IMAGE_W + w] += sample(h, w, camera_path, light_path);
+        }
+      });
+      std::cerr << "bdpt pass " << pass << std::endl;
+    }
+    // One light subpath per pixel and pass.
+    float splat_scale = 1.0f / (IMAGE_W * IMAGE_H);
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        image[h][w] = (sum[h * IMAGE_W + w] + splats_.get(h, w) * splat_scale) /
+                      static_cast<float>(spp);
+      }
+    }
+  }
+
+ private:
+  // Sets a value for the rest of the scope, for the MIS weight computation.
+  template <typename T>
+  struct Scoped {
+    Scoped(T* target, T value) : target_(target) {
+      if (target_) {
+        backup_ = *target_;
+        *target_ = value;
+      }
+    }
+    ~Scoped() {
+      if (target_) *target_ = backup_;
+    }
+    T* target_;
+    T backup_{};
+  };
+
+  // Footprint of pixel (h, w) in emitRay's coordinates. Samples spread over
+  // two pixels in each dimension, like the stratified samples of main.cc.
+  static void footprint(int h, int w, double& x0, double& x1, double& y0,
+                        double& y1) {
+    x0 = std::max(0, w - 1) / double(IMAGE_W - 1);
+    x1 = std::min(IMAGE_W - 1, w + 1) / double(IMAGE_W - 1);
+    y0 = std::max(0, h - 1) / double(IMAGE_H - 1);
+    y1 = std::min(IMAGE_H - 1, h + 1) / double(IMAGE_H - 1);
+  }
+
+  Color sample(int h, int w, std::vector<PathVertex>& camera_path,
+               std::vector<PathVertex>& light_path) {
+    double x0, x1, y0, y1;
+    footprint(h, w, x0, x1, y0, y1);
+    Color color = cameraSubpath(rand_double(x0, x1), rand_double(y0, y1),
+                                camera_path);
+    lightSubpath(light_path);
+    int t_max = static_cast<int>(camera_path.size());
+    int s_max = static_cast<int>(light_path.size());
+    for (int t = 1; t <= t_max; t++) {
+      for (int s = 0; s <= s_max; s++) {
+        int depth = s + t - 2;
+        if ((s == 1 && t == 1) || depth < 0 || depth > max_depth_) continue;
+        if (t == 1) {
+          splatToCamera(light_path, camera_path, s);
+        } else {
+          color += connect(light_path, camera_path, s, t);
+        }
+      }
+    }
+    return color;
+  }
+
+  // Returns light from camera rays that escape to the background, which no
+  // other strategy can find.
+  Color cameraSubpath(double dx, double dy, std::vector<PathVertex>& path) {
+    path.clear();
+    PathVertex lens;
+    lens.type_ = PathVertex::CAMERA;
+    lens.p_ = camera_.sampleLens();
+    lens.normal_ = camera_.lensNormal();
+    lens.beta_ = Color(1, 1, 1);
+    path.push_back(lens);
+    Ray ray = camera_.emitRay(dx, dy, lens.p_);
+    double pdf = camera_.directionPdf(lens.p_, ray.direction(),
+                                      camera_.viewportArea());
+    return randomWalk(ray, lens.beta_, pdf, path, true);
+  }
+
+  void lightSubpath(std::vector<PathVertex>& path) {
+    path.clear();
+    if (World::emitters().empty()) return;
+    double pmf;
+    size_t index = World::samplePowerLight(pmf);
+    Sphere const& light = *World::emitters()[index];
+    Direction normal = Direction::rand_unit_vec();
+    PathVertex origin;
+    origin.type_ = PathVertex::LIGHT;
+    origin.p_ = light.center() + light.radius() * normal;
+    origin.normal_ = normal;
+    origin.light_ = index;
+    origin.pdf_fwd_ = lightOriginPdf(index);
+    origin.beta_ = emitted(origin, origin.p_ + normal) /
+                   static_cast<float>(origin.pdf_fwd_);
+    path.push_back(origin);
+    // Cosine distributed emission, so beta * cos / pdf is beta * PI.
+    Direction d = (normal + Direction::rand_unit_vec()).normalize();
+    double pdf = std::max(0.0, dot(normal, d)) / PI;
+    if (pdf <= 0.0) return;
+    randomWalk(Ray(origin.p_, d), origin.beta_ * static_cast<float>(PI), pdf,
+               path, false);
+  }
+
+  // Extend path from its last vertex along ray, which was sampled with solid
+  // angle density pdf and leaves the path with throughput beta.
+  Color randomWalk(Ray ray, Color beta, double pdf,
+                   std::vector<PathVertex>& path, bool from_camera) {
+    Color escaped(0, 0, 0);
+    Color start = beta;
+    while (static_cast<int>(path.size()) <= max_depth_ + 1) {
+      Direction d = ray.direction().normalize();
+      ray = Ray(ray.origin(), d);
+      HitRecord hit_record;
+      bool hit_any = World::intersect(ray, hit_record);
+      if (from_camera && !hit_any) {
+        escaped = beta * Background::color(ray);
+        break;
+      }
+      double scatter_distance = World::medium().sampleDistance();
+      if (!hit_any && scatter_distance == INF) break;
+      PathVertex vertex;
+      double dist;
+      if (hit_any && hit_record.t_ <= scatter_distance) {
+        vertex.type_ = PathVertex::SURFACE;
+        vertex.p_ = hit_record.p_;
+        vertex.normal_ =
+            hit_record.front_face_ ? hit_record.normal_ : -hit_record.normal_;
+        vertex.hit_record_ = hit_record;
+        dist = hit_record.t_;
+      } else {
+        vertex.type_ = PathVertex::FOG;
+        vertex.p_ = ray.at(scatter_distance);
+        dist = scatter_distance;
+      }
+      PathVertex& prev = path.back();
+      vertex.pdf_fwd_ = toArea(pdf, prev, vertex);
+      if (from_camera) {
+        if (vertex.type_ == PathVertex::FOG) beta *= World::medium().albedo_;
+      } else {
+        // Traced from the camera side this segment ends at prev, which has
+        // to be a surface or in the fog along a ray that hits something.
+        if (prev.type_ == PathVertex::FOG) {
+          HitRecord reverse;
+          if (!World::intersect(Ray(vertex.p_, -d), reverse)) break;
+        }
+        beta *= static_cast<float>(segment(dist, prev) /
+                                   distanceDensity(dist, vertex));
+      }
+      vertex.beta_ = beta;
+      path.push_back(vertex);
+      PathVertex& current = path.back();
+      if (current.emissive() ||
+          static_cast<int>(path.size()) > max_depth_ + 1) {
+        break;
+      }
+
+      Ray scattered;
+      double pdf_rev;
+      if (current.type_ == PathVertex::FOG) {
+        // The phase function is symmetric in its two directions.
+        scattered = Ray(current.p_, World::medium().samplePhase(d));
+        pdf = pdf_rev = World::medium().phase(d, scattered.direction());
+      } else {
+        Material const& material = *current.hit_record_.material_;
+        Color attenuation;
+        if (!material.scatter(ray, current.hit_record_, attenuation,
+                              scattered)) {
+          break;
+        }
+        beta = beta * attenuation;
+        current.delta_ = material.isSpecular();
+        Direction wo = scattered.direction().normalize();
+        pdf = current.delta_ ? 0.0
+                             : material.pdf(ray, current.hit_record_, wo);
+        pdf_rev = current.delta_
+                      ? 0.0
+                      : directionPdf(current, current.p_ + wo, ray.origin());
+      }
+      path[path.size() - 2].pdf_rev_ =
+          toArea(pdf_rev, current, path[path.size() - 2]);
+      // Light subpaths in the fog rarely end on their own.
+      if (!from_camera && path.size() > 4) {
+        double survive = std::min(1.0, luminance(beta) / luminance(start));
+        if (!(rand_double() < survive)) break;
+        beta /= static_cast<float>(survive);
+      }
+      ray = scattered;
+    }
+    return escaped;
+  }
+
+  // Fog factor of a segment of length dist that, traced from the camera
+  // side, ends at end.
+  static double segment(double dist, PathVertex const& end) {
+    if (end.type_ == PathVertex::FOG) {
+      return World::medium().albedo_ * World::fogDensity(dist);
+    }
+    return World::fogTransmittance(dist);
+  }
+
+  // Density of a walk's distance sampling ending at vertex after dist.
+  static double distanceDensity(double dist, PathVertex const& vertex) {
+    if (vertex.type_ == PathVertex::FOG) return World::fogDensity(dist);
+    return World::fogTransmittance(dist);
+  }
+
+  // Convert a solid angle density at from into a density at to.
+  static double toArea(double pdf, PathVertex const& from,
+                       PathVertex const& to) {
+    Direction d = to.p_ - from.p_;
+    double dist_squared = d.lenSquared();
+    if (dist_squared == 0.0) return 0.0;
+    double dist = sqrt(dist_squared);
+    pdf *= distanceDensity(dist, to) / dist_squared;
+    if (to.type_ != PathVertex::FOG) {
+      pdf *= std::abs(dot(to.normal_, d / dist));
+    }
+    return pdf;
+  }
+
+  // vertex's hit record with its normal facing a ray arriving from from.
+  static HitRecord facing(PathVertex const& vertex, Point const& from) {
+    HitRecord hit_record = vertex.hit_record_;
+    hit_record.setFaceNormal(Ray(from, vertex.p_ - from), vertex.normal_);
+    return hit_record;
+  }
+
+  // Solid angle density of scattering at vertex toward to, having arrived
+  // from from.
+  double directionPdf(PathVertex const& vertex, Point const& from,
+                      Point const& to) const {
+    Direction wo = (to - vertex.p_).normalize();
+    switch (vertex.type_) {
+      case PathVertex::CAMERA:
+        return camera_.directionPdf(vertex.p_, wo, camera_.viewportArea());
+      case PathVertex::LIGHT:
+        return std::max(0.0, dot(vertex.normal_, wo)) / PI;
+      case PathVertex::FOG:
+        return World::medium().phase((vertex.p_ - from).normalize(), wo);
+      case PathVertex::SURFACE:
+        break;
+    }
+    Material const& material = *vertex.hit_record_.material_;
+    if (material.isSpecular()) return 0.0;
+    return material.pdf(Ray(from, vertex.p_ - from), facing(vertex, from), wo);
+  }
+
+  // Density of vertex, after next, as a vertex of the path toward next.
+  double pdf(PathVertex const& vertex, PathVertex const* prev,
+             PathVertex const& next) const {
+    if (vertex.emissive() && vertex.type_ != PathVertex::CAMERA && !prev) {
+      // An emitter that starts a light subpath.
+      Direction wo = (next.p_ - vertex.p_).normalize();
+      return toArea(std::max(0.0, dot(vertex.normal_, wo)) / PI, vertex,
+                    next);
+    }
+    Point from = prev ? prev->p_ : vertex.p_;
+    return toArea(directionPdf(vertex, from, next.p_), vertex, next);
+  }
+
+  static double lightOriginPdf(size_t index) {
+    Sphere const& light = *World::emitters()[index];
+    return World::powerLightPmf(index) /
+           (4.0 * PI * light.radius() * light.radius());
+  }
+
+  // BSDF at vertex for light arriving from from and leaving toward to, with
+  // no cosine term, or the phase function in the fog.
+  static Color bsdf(PathVertex const& vertex, Point const& from,
+                    Point const& to) {
+    if (vertex.type_ == PathVertex::FOG) {
+      float phase = World::medium().phase((vertex.p_ - from).normalize(),
+                                          (to - vertex.p_).normalize());
+      return Color(phase, phase, phase);
+    }
+    Material const& material = *vertex.hit_record_.material_;
+    if (material.isSpecular()) return Color(0, 0, 0);
+    // None of the non-specular materials transmit.
+    if (dot(vertex.normal_, from - vertex.p_) *
+            dot(vertex.normal_, to - vertex.p_) <=
+        0) {
+      return Color(0, 0, 0);
+    }
+    HitRecord hit_record = facing(vertex, from);
+    Direction wo = (to - vertex.p_).normalize();
+    double cos_theta = std::abs(dot(hit_record.normal_, wo));
+    if (cos_theta == 0.0) return Color(0, 0, 0);
+    return material.eval(Ray(from, vertex.p_ - from), hit_record, wo) /
+           static_cast<float>(cos_theta);
+  }
+
+  // Radiance an emitter vertex sends toward to.
+  static Color emitted(PathVertex const& vertex, Point const& to) {
+    if (dot(vertex.normal_, to - vertex.p_) <= 0) return Color(0, 0, 0);
+    Sphere const& light =
+        *World::emitters()[vertex.type_ == PathVertex::LIGHT
+                               ? vertex.light_
+                               : World::lightIndex(
+                                     vertex.hit_record_.hittable_)];
+    HitRecord hit_record;
+    hit_record.p_ = vertex.p_;
+    hit_record.normal_ = vertex.normal_;
+    hit_record.front_face_ = true;
+    return light.material()->emit(hit_record);
+  }
+
+  // Fog factor, cosines and inverse squared distance between camera side
+  // vertex a and light side vertex b, or 0 if they can't see each other.
+  static double geometry(PathVertex const& a, PathVertex const& b) {
+    Direction d = b.p_ - a.p_;
+    double dist = d.len();
+    if (dist <= 1e-3) return 0.0;
+    d = d / dist;
+    HitRecord hit_record;
+    bool hit_any = World::intersect(Ray(a.p_, d), hit_record);
+    if (hit_any && hit_record.t_ < dist * (1 - 1e-6)) return 0.0;
+    if (b.type_ == PathVertex::FOG && !hit_any) return 0.0;
+    double g = segment(dist, b) / (dist * dist);
+    if (a.type_ != PathVertex::FOG && a.type_ != PathVertex::CAMERA) {
+      g *= std::abs(dot(a.normal_, d));
+    }
+    if (b.type_ != PathVertex::FOG) g *= std::abs(dot(b.normal_, d));
+    return g;
+  }
+
+  Color connect(std::vector<PathVertex>& light_path,
+                std::vector<PathVertex>& camera_path, int s, int t) {
+    PathVertex& pt = camera_path[t - 1];
+    if (s == 0) {
+      if (!pt.emissive() || pt.type_ != PathVertex::SURFACE) {
+        return Color(0, 0, 0);
+      }
+      Color c = pt.beta_ * emitted(pt, camera_path[t - 2].p_);
+      if (c.x() <= 0 && c.y() <= 0 && c.z() <= 0) return c;
+      return c * static_cast<float>(misWeight(light_path, camera_path, s, t,
+                                              nullptr));
+    }
+    if (pt.delta_ || pt.emissive()) return Color(0, 0, 0);
+    Point const& before = camera_path[t - 2].p_;
+
+    if (s == 1) {
+      // Sample a point on an emitter as seen from pt.
+      double select_pdf, pdf;
+      size_t index = World::selectLight(
+          pt.p_, pt.type_ == PathVertex::FOG ? nullptr : &pt.normal_,
+          select_pdf);
+      Sphere const& light = *World::emitters()[index];
+      Direction wi;
+      HitRecord light_record;
+      if (select_pdf <= 0.0 || !light.sampleDirection(pt.p_, wi, pdf) ||
+          !light.hit(Ray(pt.p_, wi), 1e-3, INF, light_record)) {
+        return Color(0, 0, 0);
+      }
+      PathVertex sampled;
+      sampled.type_ = PathVertex::LIGHT;
+      sampled.p_ = light_record.p_;
+      sampled.normal_ = (light_record.p_ - light.center()) / light.radius();
+      sampled.light_ = index;
+      sampled.pdf_fwd_ = lightOriginPdf(index);
+      double dist = light_record.t_;
+      double area_pdf = select_pdf * pdf *
+                        std::abs(dot(sampled.normal_, wi)) / (dist * dist);
+      sampled.beta_ =
+          emitted(sampled, pt.p_) / static_cast<float>(area_pdf);
+      Color c = pt.beta_ * bsdf(pt, before, sampled.p_) * sampled.beta_;
+      if (c.x() <= 0 && c.y() <= 0 && c.z() <= 0) return c;
+      double g = geometry(pt, sampled);
+      if (g <= 0.0) return Color(0, 0, 0);
+      return c * static_cast<float>(
+                     g * misWeight(light_path, camera_path, s, t, &sampled));
+    }
+
+    PathVertex& qs = light_path[s - 1];
+    if (qs.delta_ || qs.emissive()) return Color(0, 0, 0);
+    Color c = pt.beta_ * bsdf(pt, before, qs.p_) *
+              bsdf(qs, light_path[s - 2].p_, pt.p_) * qs.beta_;
+    if (c.x() <= 0 && c.y() <= 0 && c.z() <= 0) return c;
+    double g = geometry(pt, qs);
+    if (g <= 0.0) return Color(0, 0, 0);
+    return c *
+           static_cast<float>(g * misWeight(light_path, camera_path, s, t,
+                                            nullptr));
+  }
+
+  // Connect light subpath vertex s - 1 to a fresh point on the lens, and
+  // splat the result onto the pixels whose footprint it lands in.
+  void splatToCamera(std::vector<PathVertex>& light_path,
+                     std::vector<PathVertex>& camera_path, int s) {
+    PathVertex& qs = light_path[s - 1];
+    if (qs.delta_ || camera_.lensArea() <= 0.0) return;
+    PathVertex lens;
+    lens.type_ = PathVertex::CAMERA;
+    lens.p_ = camera_.sampleLens();
+    lens.normal_ = camera_.lensNormal();
+    double dx, dy;
+    if (!camera_.raster(lens.p_, qs.p_, dx, dy) || dx < 0 || dx > 1 ||
+        dy < 0 || dy > 1) {
+      return;
+    }
+    Color c = s == 1 ? emitted(qs, lens.p_)
+                     : bsdf(qs, light_path[s - 2].p_, lens.p_);
+    c = c * qs.beta_;
+    if (c.x() <= 0 && c.y() <= 0 && c.z() <= 0) return;
+    // The lens cosine and area cancel between importance and lens density.
+    double g = geometry(lens, qs);
+    if (g <= 0.0) return;
+    double weight = misWeight(light_path, camera_path, s, 1, &lens);
+    Direction d = qs.p_ - lens.p_;
+    int w0 = static_cast<int>(std::floor(dx * (IMAGE_W - 1)));
+    int h0 = static_cast<int>(std::floor(dy * (IMAGE_H - 1)));
+    for (int h = std::max(0, h0); h <= std::min(IMAGE_H - 1, h0 + 1); h++) {
+      for (int w = std::max(0, w0); w <= std::min(IMAGE_W - 1, w0 + 1); w++) {
+        double x0, x1, y0, y1;
+        footprint(h, w, x0, x1, y0, y1);
+        if (dx < x0 || dx > x1 || dy < y0 || dy > y1) continue;
+        double area = (x1 - x0) * (y1 - y0) * camera_.viewportArea();
+        double importance = camera_.directionPdf(lens.p_, d, area);
+        splats_.splat(h, w, c * static_cast<float>(g * importance * weight));
+      }
+    }
+  }
+
+  // Balance heuristic weight of connecting light subpath vertex s - 1 with
+  // camera subpath vertex t - 1, with sampled replacing the vertex that the
+  // connection sampled afresh, if any.
+  double misWeight(std::vector<PathVertex>& light_path,
+                   std::vector<PathVertex>& camera_path, int s, int t,
+                   PathVertex const* sampled) const {
+    if (s + t == 2) return 1.0;
+    Scoped<PathVertex> replace_light(s == 1 && sampled ? &light_path[0]
+                                                       : nullptr,
+                                     sampled ? *sampled : PathVertex());
+    Scoped<PathVertex> replace_camera(t == 1 && sampled ? &camera_path[0]
+                                                        : nullptr,
+                                      sampled ? *sampled : PathVertex());
+    PathVertex* qs = s > 0 ? &light_path[s - 1] : nullptr;
+    PathVertex* pt = &camera_path[t - 1];
+    PathVertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+    PathVertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+    // The connection endpoints are connectible even if they weren't while
+    // tracing, and get the densities of being generated from the other side.
+    Scoped<bool> pt_delta(&pt->delta_, false);
+    Scoped<bool> qs_delta(qs ? &qs->delta_ : nullptr, false);
+    Scoped<double> pt_rev(&pt->pdf_rev_,
+                          s > 0 ? pdf(*qs, qs_minus, *pt)
+                                : lightOriginPdf(World::lightIndex(
+                                      pt->hit_record_.hittable_)));
+    Scoped<double> pt_minus_rev(
+        pt_minus ? &pt_minus->pdf_rev_ : nullptr,
+        pt_minus ? (s > 0 ? pdf(*pt, qs, *pt_minus)
+                          : pdf(*pt, nullptr, *pt_minus))
+                 : 0.0);
+    Scoped<double> qs_rev(qs ? &qs->pdf_rev_ : nullptr,
+                          qs ? pdf(*pt, pt_minus, *qs) : 0.0);
+    Scoped<double> qs_minus_rev(qs_minus ? &qs_minus->pdf_rev_ : nullptr,
+                                qs_minus ? pdf(*qs, pt, *qs_minus) : 0.0);
+
+    auto remap = [](double f) { return f != 0.0 ? f : 1.0; };
+    double sum = 0.0, ratio = 1.0;
+    for (int i = t - 1; i > 0; i--) {
+      ratio *= remap(camera_path[i].pdf_rev_) / remap(camera_path[i].pdf_fwd_);
+      if (!camera_path[i].delta_ && !camera_path[i - 1].delta_) sum += ratio;
+    }
+    ratio = 1.0;
+    for (int i = s - 1; i >= 0; i--) {
+      ratio *= remap(light_path[i].pdf_rev_) / remap(light_path[i].pdf_fwd_);
+      bool delta_before = i > 0 && light_path[i - 1].delta_;
+      if (!light_path[i].delta_ && !delta_before) sum += ratio;
+    }
+    return 1.0 / (1.0 + sum);
+  }
+
+  Camera const& camera_;
+  int max_depth_;
+  SplatBuffer splats_;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define CAMERA_H
 #include <array>
 #include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <vector>
 
@@ -49,11 +50,54 @@ struct Camera {
     len_radius_ = aperture / 2.0;
   }
 
-  Ray emitRay(double dx, double dy) {
-    Direction rd = len_radius_ * Direction::rand_unit_vec_in_xy_plane();
-    Direction offset = rd.x() * x_ + rd.y() * y_;
-    return Ray(origin_ + offset, lower_left_ + dx * horizontal_ +
-                                     dy * vertical_ - origin_ - offset);
+  Ray emitRay(double dx, double dy) { return emitRay(dx, dy, sampleLens()); }
+
+  // The ray from lens point through (dx, dy) on the focus plane.
+  Ray emitRay(double dx, double dy, Point const& lens) const {
+    return Ray(lens, lower_left_ + dx * horizontal_ + dy * vertical_ - lens);
+  }
+
+  // Uniform over the lens disk, so that the lens has an area to connect
+  // light paths to.
+  Point sampleLens() const {
+    Direction rd = len_radius_ * Direction::rand_in_unit_disk();
+    return origin_ + rd.x() * x_ + rd.y() * y_;
+  }
+  // The lens center, where a pinhole camera's rays would start.
+  Point lensCenter() const { return origin_; }
+  double lensArea() const {
+    return PI * len_radius_ * len_radius_ * cross(x_, y_).len();
+  }
+  Direction lensNormal() const { return cross(x_, y_).normalize(); }
+
+  // Area of the focus plane region spanned by dx, dy in [0, 1].
+  double viewportArea() const { return horizontal_.len() * vertical_.len(); }
+
+  // Where the line from lens through p crosses the focus plane, in emitRay's
+  // (dx, dy) coordinates. Return false if p is behind the lens.
+  bool raster(Point const& lens, Point const& p, double& dx,
+              double& dy) const {
+    Direction n = cross(horizontal_, vertical_);
+    double denom = dot(p - lens, n);
+    if (denom == 0.0) return false;
+    double s = dot(lower_left_ - lens, n) / denom;
+    if (s <= 0.0) return false;
+    Direction q = lens + s * (p - lens) - lower_left_;
+    dx = dot(q, horizontal_) / horizontal_.lenSquared();
+    dy = dot(q, vertical_) / vertical_.lenSquared();
+    return true;
+  }
+
+  // Solid angle density at lens of camera rays in direction d, when their
+  // focus plane points are uniform over a region of the given area.
+  double directionPdf(Point const& lens, Direction const& d,
+                      double area) const {
+    Direction n = cross(horizontal_, vertical_).normalize();
+    Direction unit = d.normalize();
+    double cos_theta = std::abs(dot(unit, n));
+    if (cos_theta == 0.0 || area <= 0.0) return 0.0;
+    double dist = std::abs(dot(lower_left_ - lens, n)) / cos_theta;
+    return dist * dist / (area * cos_theta);
   }
 
  private:
@@ -66,8 +110,11 @@ struct Camera {
 };
 
 struct ImagePrinter {
+  // Written to a temporary file renamed over filename, so that readers see
+  // either the old image or the new one whole.
   static void printPpm(Image const& image, std::string filename) {
-    std::ofstream file(filename);
+    std::string temporary = filename + ".tmp";
+    std::ofstream file(temporary);
     // Print header.
     file << "P3\n" << IMAGE_W << ' ' << IMAGE_H << "\n255\n";
     // Print color of each pixel.
@@ -80,6 +127,7 @@ struct ImagePrinter {
       }
     }
     file.close();
+    std::rename(temporary.c_str(), filename.c_str());
   }
 };
 
@@ -0,0 +1,86 @@
+#ifndef CAUSTICS_H
+#define CAUSTICS_H
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "parallel.h"
+#include "photon_map.h"
+#include "world.h"
+
+// The photon pass for caustics: photons leave the emissive spheres, bounce
+// through specular Metal and Dielectric spheres, and are stored where they
+// first land on a diffuse surface. Photons that reach a diffuse surface
+// directly are dropped, since path tracing finds that light well, and the
+// fog only attenuates them, since path tracing finds the light it scatters.
+struct Caustics {
+  static PhotonMap build(int photon_cnt) {
+    if (photon_cnt <= 0 || World::emitters().empty()) return PhotonMap();
+    auto start = std::chrono::steady_clock::now();
+    constexpr int CHUNKS = 64;
+    std::vector<std::vector<Photon>> chunks(CHUNKS);
+    parallelRows(CHUNKS, [&](int chunk) {
+      int begin = static_cast<long long>(photon_cnt) * chunk / CHUNKS;
+      int end = static_cast<long long>(photon_cnt) * (chunk + 1) / CHUNKS;
+      for (int i = begin; i < end; i++) trace(photon_cnt, chunks[chunk]);
+    });
+    std::vector<Photon> photons;
+    for (std::vector<Photon> const& chunk : chunks) {
+      photons.insert(photons.end(), chunk.begin(), chunk.end());
+    }
+    auto traced = std::chrono::steady_clock::now();
+    PhotonMap map(std::move(photons));
+    auto built = std::chrono::steady_clock::now();
+    std::cerr << "caustics: " << map.size() << " of " << photon_cnt
+              << " photons stored, traced in " << seconds(traced - start)
+              << "s, kd-tree built in " << seconds(built - traced) << "s"
+              << std::endl;
+    return map;
+  }
+
+ private:
+  // Emit one of photon_cnt photons, each carrying its share of the total
+  // emitted power.
+  static void trace(int photon_cnt, std::vector<Photon>& photons) {
+    double pmf;
+    Sphere const& light = *World::emitters()[World::samplePowerLight(pmf)];
+    Direction normal = Direction::rand_unit_vec();
+    HitRecord emitter;
+    emitter.p_ = light.center() + light.radius() * normal;
+    emitter.normal_ = normal;
+    emitter.front_face_ = true;
+    double area = 4.0 * PI * light.radius() * light.radius();
+    // Cosine distributed directions, so the cosine and PI cancel the density.
+    Color power = light.material()->emit(emitter) *
+                  static_cast<float>(PI * area / (pmf * photon_cnt));
+    Ray ray(emitter.p_, (normal + Direction::rand_unit_vec()).normalize());
+    for (int bounce = 0; bounce <= MAX_REFLECTION; bounce++) {
+      HitRecord hit_record;
+      if (!World::intersect(ray, hit_record)) return;
+      power *=
+          static_cast<float>(World::fogTransmittance(ray, hit_record.t_));
+      Material const& material = *hit_record.material_;
+      if (material.isEmissive()) return;
+      if (!material.isSpecular()) {
+        if (bounce > 0) {
+          photons.push_back(Photon{hit_record.p_, hit_record.hittable_,
+                                   hit_record.front_face_, -ray.direction(),
+                                   power});
+        }
+        return;
+      }
+      Color attenuation;
+      Ray scattered;
+      if (!material.scatter(ray, hit_record, attenuation, scattered)) return;
+      power = power * attenuation;
+      ray = Ray(scattered.origin(), scattered.direction().normalize());
+    }
+  }
+
+  template <typename Duration>
+  static double seconds(Duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  }
+};
+
+#endif
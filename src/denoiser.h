@@ -0,0 +1,378 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aov.h"
+#include "camera.h"
+#include "film.h"
+#include "parallel.h"
+#include "world.h"
+
+// Edge-avoiding A-trous wavelet denoising (Dammertz et al. 2010) with the
+// variance-driven luminance weight of SVGF (Schied et al. 2017). Each
+// iteration blurs with a 5 x 5 B3 spline kernel whose taps are step pixels
+// apart, doubling step every time, and weighs each tap down by how much its
+// first-hit albedo, normal and distance and its luminance differ from the
+// center's: the normals by their cosine to the 128th power, the rest by
+// exp(-|albedo difference|_1 / sigma_albedo -
+//     |distance difference| / (sigma_depth * distance * pixels apart) -
+//     |luminance difference| / (sigma_luminance * standard deviation)).
+// The standard deviation is that of the luminance estimate, from the
+// film's per-pixel variance, blurred by 3 x 3 before every iteration and
+// carried through them. The filter runs on the radiance divided by the
+// first-hit albedo, so that texture detail doesn't blur, and multiplies it
+// back at the end. The features are the AOVs of the film's own paths.
+// Rows run on all threads, and with SSE2 four pixels at a time.
+class AtrousDenoiser {
+ public:
+  AtrousDenoiser()
+      : albedo_r_(IMAGE_W * IMAGE_H),
+        albedo_g_(IMAGE_W * IMAGE_H),
+        albedo_b_(IMAGE_W * IMAGE_H),
+        normal_x_(IMAGE_W * IMAGE_H),
+        normal_y_(IMAGE_W * IMAGE_H),
+        normal_z_(IMAGE_W * IMAGE_H),
+        depth_(IMAGE_W * IMAGE_H) {}
+
+  // Take the first-hit albedo, normal and distance from aovs, which must
+  // have them, recorded by the paths of the film to filter.
+  void setFeatures(AovFramebuffer const& aovs) {
+    parallelRows(IMAGE_H, [&](int h) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        int i = h * IMAGE_W + w;
+        Color albedo = aovs.mean(h, w, AOV_ALBEDO);
+        albedo_r_[i] = albedo.x();
+        albedo_g_[i] = albedo.y();
+        albedo_b_[i] = albedo.z();
+        Color normal = aovs.mean(h, w, AOV_NORMAL);
+        // Misses have none, so no weight would count the pixel itself.
+        if (normal.nearZero()) normal = Color(0, 1, 0);
+        normal = normal.normalize();
+        normal_x_[i] = normal.x();
+        normal_y_[i] = normal.y();
+        normal_z_[i] = normal.z();
+        depth_[i] = aovs.mean(h, w, AOV_DEPTH).x();
+      }
+    });
+  }
+
+  // Filter the means of film into image.
+  void denoise(Film const& film, Image& image) {
+    auto start = Clock::now();
+    Options const& options = Options::get();
+    int n = IMAGE_W * IMAGE_H;
+    Channels current(n), next(n);
+    parallelRows(IMAGE_H, [&](int h) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        int i = h * IMAGE_W + w;
+        Color albedo = demodulation(i);
+        Color color = film.mean(h, w);
+        current.r_[i] = color.x() / albedo.x();
+        current.g_[i] = color.y() / albedo.y();
+        current.b_[i] = color.z() / albedo.z();
+        double y = ::luminance(albedo);
+        current.variance_[i] = film.variance(h, w) / (y * y);
+      }
+    });
+    std::vector<float> deviation(n);
+    for (int iteration = 0; iteration < options.denoise_iterations;
+         iteration++) {
+      int step = 1 << iteration;
+      parallelRows(IMAGE_H, [&](int h) {
+        blurVariance(current.variance_, deviation, h);
+      });
+      Kernel kernel(step, options.denoise_sigma_luminance,
+                    options.denoise_sigma_albedo, options.denoise_sigma_depth);
+      parallelRows(IMAGE_H, [&](int h) {
+        int w = 0;
+#ifdef __SSE2__
+        // Four pixels at a time where all their taps are in the image.
+        for (; w < std::min(2 * step, IMAGE_W); w++) {
+          filterPixel(kernel, current, deviation, next, h, w);
+        }
+        for (; w + 3 + 2 * step < IMAGE_W; w += 4) {
+          filterPixels(kernel, current, deviation, next, h, w);
+        }
+#endif
+        for (; w < IMAGE_W; w++) {
+          filterPixel(kernel, current, deviation, next, h, w);
+        }
+      });
+      std::swap(current, next);
+    }
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        int i = h * IMAGE_W + w;
+        image[h][w] = Color(current.r_[i], current.g_[i], current.b_[i]) *
+                      demodulation(i);
+      }
+    }
+    filter_seconds_ = seconds(Clock::now() - start);
+  }
+
+  void printStats() const {
+    std::cerr << "denoiser: filtered in " << filter_seconds_ << " s"
+              << std::endl;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  static double seconds(Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  }
+
+  // Demodulated radiance and its luminance variance, one float per pixel
+  // and channel so that neighboring pixels load together.
+  struct Channels {
+    explicit Channels(int n) : r_(n), g_(n), b_(n), variance_(n) {}
+    std::vector<float> r_, g_, b_, variance_;
+  };
+
+  // The taps of one iteration: their offsets, spline weights and the
+  // reciprocal of the pixels they are apart.
+  struct Kernel {
+    Kernel(int step, double sigma_luminance, double sigma_albedo,
+           double sigma_depth)
+        : sigma_luminance_(sigma_luminance),
+          albedo_scale_(1.0 / sigma_albedo),
+          sigma_depth_(sigma_depth) {
+      static float const SPLINE[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4,
+                                      1.0f / 16};
+      for (int j = 0; j < 5; j++) {
+        for (int i = 0; i < 5; i++) {
+          int t = 5 * j + i;
+          dx_[t] = (i - 2) * step;
+          dy_[t] = (j - 2) * step;
+          weight_[t] = SPLINE[i] * SPLINE[j];
+          double apart = std::sqrt(dx_[t] * dx_[t] + dy_[t] * dy_[t]);
+          inverse_apart_[t] = t == 12 ? 0.0f : 1.0f / apart;
+        }
+      }
+    }
+
+    int dx_[25], dy_[25];
+    float weight_[25], inverse_apart_[25];
+    float sigma_luminance_, albedo_scale_, sigma_depth_;
+  };
+
+  // The albedo pixel i's radiance is divided by, 1 for channels too dark
+  // to divide.
+  Color demodulation(int i) const {
+    return Color(albedo_r_[i] > 0.01f ? albedo_r_[i] : 1.0f,
+                 albedo_g_[i] > 0.01f ? albedo_g_[i] : 1.0f,
+                 albedo_b_[i] > 0.01f ? albedo_b_[i] : 1.0f);
+  }
+
+  // The standard deviation from the variance blurred by a 3 x 3 binomial
+  // kernel, renormalized at the border, for row h.
+  static void blurVariance(std::vector<float> const& variance,
+                           std::vector<float>& deviation, int h) {
+    static float const BINOMIAL[3] = {0.25f, 0.5f, 0.25f};
+    for (int w = 0; w < IMAGE_W; w++) {
+      float sum = 0.0f, total = 0.0f;
+      for (int j = -1; j <= 1; j++) {
+        if (h + j < 0 || h + j >= IMAGE_H) continue;
+        for (int i = -1; i <= 1; i++) {
+          if (w + i < 0 || w + i >= IMAGE_W) continue;
+          float weight = BINOMIAL[j + 1] * BINOMIAL[i + 1];
+          sum += weight * variance[(h + j) * IMAGE_W + w + i];
+          total += weight;
+        }
+      }
+      deviation[h * IMAGE_W + w] = std::sqrt(sum / total);
+    }
+  }
+
+  static float luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+  }
+
+  // Raise a cosine, at least 0, to the 128th power.
+  static float power128(float x) {
+    for (int i = 0; i < 7; i++) x *= x;
+    return x;
+  }
+
+  // e ^ x for x <= 0, to a relative error of 2e-5: 2 ^ (x / ln 2) as the
+  // exponent bits of its integer part times a polynomial for the rest, the
+  // way the SSE2 version computes it.
+  static float exponential(float x) {
+    float t = std::max(x, -80.0f) * 1.44269504f;
+    float whole = std::floor(t), f = t - whole;
+    float p = 1.0f + f * (0.693147181f +
+                          f * (0.240226507f +
+                               f * (0.0555041087f +
+                                    f * (0.00961812911f +
+                                         f * (0.00133335581f +
+                                              f * 0.000154035304f)))));
+    int32_t bits = (static_cast<int32_t>(whole) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+  }
+
+  void filterPixel(Kernel const& kernel, Channels const& in,
+                   std::vector<float> const& deviation, Channels& out, int h,
+                   int w) const {
+    int p = h * IMAGE_W + w;
+    float luminance_p = luminance(in.r_[p], in.g_[p], in.b_[p]);
+    float luminance_scale =
+        1.0f / (kernel.sigma_luminance_ * deviation[p] + 1e-4f);
+    float depth_scale = 1.0f / (kernel.sigma_depth_ * depth_[p] + 1e-4f);
+    float r = 0.0f, g = 0.0f, b = 0.0f, variance = 0.0f, total = 0.0f;
+    for (int t = 0; t < 25; t++) {
+      int y = h + kernel.dy_[t], x = w + kernel.dx_[t];
+      if (y < 0 || y >= IMAGE_H || x < 0 || x >= IMAGE_W) continue;
+      int q = y * IMAGE_W + x;
+      float cosine = normal_x_[p] * normal_x_[q] +
+                     normal_y_[p] * normal_y_[q] + normal_z_[p] * normal_z_[q];
+      float albedo_difference = std::abs(albedo_r_[p] - albedo_r_[q]) +
+                                std::abs(albedo_g_[p] - albedo_g_[q]) +
+                                std::abs(albedo_b_[p] - albedo_b_[q]);
+      float exponent =
+          std::abs(luminance_p - luminance(in.r_[q], in.g_[q], in.b_[q])) *
+              luminance_scale +
+          albedo_difference * kernel.albedo_scale_ +
+          std::abs(depth_[p] - depth_[q]) * depth_scale *
+              kernel.inverse_apart_[t];
+      float weight = kernel.weight_[t] *
+                     power128(std::max(0.0f, cosine)) * exponential(-exponent);
+      r += weight * in.r_[q];
+      g += weight * in.g_[q];
+      b += weight * in.b_[q];
+      variance += weight * weight * in.variance_[q];
+      total += weight;
+    }
+    out.r_[p] = r / total;
+    out.g_[p] = g / total;
+    out.b_[p] = b / total;
+    out.variance_[p] = variance / (total * total);
+  }
+
+#ifdef __SSE2__
+  static __m128 absolute(__m128 x) {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+  }
+
+  static __m128 luminance(__m128 r, __m128 g, __m128 b) {
+    return _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f), r),
+                   _mm_mul_ps(_mm_set1_ps(0.7152f), g)),
+        _mm_mul_ps(_mm_set1_ps(0.0722f), b));
+  }
+
+  static __m128 power128(__m128 x) {
+    for (int i = 0; i < 7; i++) x = _mm_mul_ps(x, x);
+    return x;
+  }
+
+  static __m128 exponential(__m128 x) {
+    __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)),
+                          _mm_set1_ps(1.44269504f));
+    // Floor: truncate, then step down where that rounded up.
+    __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    whole = _mm_sub_ps(
+        whole, _mm_and_ps(_mm_cmpgt_ps(whole, t), _mm_set1_ps(1.0f)));
+    __m128 f = _mm_sub_ps(t, whole);
+    static float const COEFFICIENTS[6] = {
+        0.000154035304f, 0.00133335581f, 0.00961812911f,
+        0.0555041087f,   0.240226507f,   0.693147181f};
+    __m128 p = _mm_set1_ps(COEFFICIENTS[0]);
+    for (int i = 1; i < 6; i++) {
+      p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(COEFFICIENTS[i]));
+    }
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+    __m128i bits = _mm_slli_epi32(
+        _mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+  }
+
+  // filterPixel for pixels w to w + 3, all of whose taps are inside the
+  // image horizontally.
+  void filterPixels(Kernel const& kernel, Channels const& in,
+                    std::vector<float> const& deviation, Channels& out, int h,
+                    int w) const {
+    int p = h * IMAGE_W + w;
+    __m128 normal_x = _mm_loadu_ps(&normal_x_[p]);
+    __m128 normal_y = _mm_loadu_ps(&normal_y_[p]);
+    __m128 normal_z = _mm_loadu_ps(&normal_z_[p]);
+    __m128 albedo_r = _mm_loadu_ps(&albedo_r_[p]);
+    __m128 albedo_g = _mm_loadu_ps(&albedo_g_[p]);
+    __m128 albedo_b = _mm_loadu_ps(&albedo_b_[p]);
+    __m128 depth = _mm_loadu_ps(&depth_[p]);
+    __m128 luminance_p =
+        luminance(_mm_loadu_ps(&in.r_[p]), _mm_loadu_ps(&in.g_[p]),
+                  _mm_loadu_ps(&in.b_[p]));
+    __m128 epsilon = _mm_set1_ps(1e-4f);
+    __m128 luminance_scale = _mm_div_ps(
+        _mm_set1_ps(1.0f),
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kernel.sigma_luminance_),
+                              _mm_loadu_ps(&deviation[p])),
+                   epsilon));
+    __m128 depth_scale = _mm_div_ps(
+        _mm_set1_ps(1.0f),
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kernel.sigma_depth_), depth),
+                   epsilon));
+    __m128 zero = _mm_setzero_ps();
+    __m128 r = zero, g = zero, b = zero, variance = zero, total = zero;
+    for (int t = 0; t < 25; t++) {
+      int y = h + kernel.dy_[t];
+      if (y < 0 || y >= IMAGE_H) continue;
+      int q = y * IMAGE_W + w + kernel.dx_[t];
+      __m128 r_q = _mm_loadu_ps(&in.r_[q]);
+      __m128 g_q = _mm_loadu_ps(&in.g_[q]);
+      __m128 b_q = _mm_loadu_ps(&in.b_[q]);
+      __m128 cosine = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(normal_x, _mm_loadu_ps(&normal_x_[q])),
+                     _mm_mul_ps(normal_y, _mm_loadu_ps(&normal_y_[q]))),
+          _mm_mul_ps(normal_z, _mm_loadu_ps(&normal_z_[q])));
+      __m128 luminance_difference =
+          absolute(_mm_sub_ps(luminance_p, luminance(r_q, g_q, b_q)));
+      __m128 depth_difference =
+          absolute(_mm_sub_ps(depth, _mm_loadu_ps(&depth_[q])));
+      __m128 albedo_difference = _mm_add_ps(
+          _mm_add_ps(
+              absolute(_mm_sub_ps(albedo_r, _mm_loadu_ps(&albedo_r_[q]))),
+              absolute(_mm_sub_ps(albedo_g, _mm_loadu_ps(&albedo_g_[q])))),
+          absolute(_mm_sub_ps(albedo_b, _mm_loadu_ps(&albedo_b_[q]))));
+      __m128 exponent = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(luminance_difference, luminance_scale),
+                     _mm_mul_ps(albedo_difference,
+                                _mm_set1_ps(kernel.albedo_scale_))),
+          _mm_mul_ps(_mm_mul_ps(depth_difference, depth_scale),
+                     _mm_set1_ps(kernel.inverse_apart_[t])));
+      __m128 weight = _mm_mul_ps(
+          _mm_mul_ps(_mm_set1_ps(kernel.weight_[t]),
+                     power128(_mm_max_ps(zero, cosine))),
+          exponential(_mm_sub_ps(zero, exponent)));
+      r = _mm_add_ps(r, _mm_mul_ps(weight, r_q));
+      g = _mm_add_ps(g, _mm_mul_ps(weight, g_q));
+      b = _mm_add_ps(b, _mm_mul_ps(weight, b_q));
+      variance = _mm_add_ps(
+          variance, _mm_mul_ps(_mm_mul_ps(weight, weight),
+                               _mm_loadu_ps(&in.variance_[q])));
+      total = _mm_add_ps(total, weight);
+    }
+    _mm_storeu_ps(&out.r_[p], _mm_div_ps(r, total));
+    _mm_storeu_ps(&out.g_[p], _mm_div_ps(g, total));
+    _mm_storeu_ps(&out.b_[p], _mm_div_ps(b, total));
+    _mm_storeu_ps(&out.variance_[p],
+                  _mm_div_ps(variance, _mm_mul_ps(total, total)));
+  }
+#endif
+
+  std::vector<float> albedo_r_, albedo_g_, albedo_b_;
+  std::vector<float> normal_x_, normal_y_, normal_z_, depth_;
+  double filter_seconds_ = 0.0;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "alias_table.h"
+#include "texture.h"
+#include "utility.h"
+#include "vec3.h"
+
+// Radiance arriving from infinitely far away, read from an equirectangular
+// image such as a Radiance .hdr: columns span the azimuth around the y axis
+// and rows the polar angle from +y at the top. Each pixel is constant over
+// its patch of the sphere, and an alias table over the pixels, in
+// proportion to their luminance times the solid angle of their patch, picks
+// directions toward bright regions such as the sun in O(1).
+class EnvironmentMap {
+ public:
+  EnvironmentMap(char const* filename, double scale) {
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    int components;
+    float* data = stbi_loadf(filename, &width_, &height_, &components, 3);
+    auto loaded = Clock::now();
+    if (!data) {
+      std::cerr << "cannot load " << filename << ": " << stbi_failure_reason()
+                << std::endl;
+      width_ = height_ = 0;
+      return;
+    }
+    pixels_.resize(static_cast<size_t>(width_) * height_);
+    std::vector<double> weights(pixels_.size());
+    for (int y = 0; y < height_; y++) {
+      double sin_theta = std::sin(PI * (y + 0.5) / height_);
+      for (int x = 0; x < width_; x++) {
+        size_t i = static_cast<size_t>(y) * width_ + x;
+        pixels_[i] = Color(data[3 * i], data[3 * i + 1], data[3 * i + 2]) *
+                     static_cast<float>(scale);
+        weights[i] = luminance(pixels_[i]) * sin_theta;
+      }
+    }
+    stbi_image_free(data);
+    table_.build(weights);
+    load_seconds_ = std::chrono::duration<double>(loaded - start).count();
+    build_seconds_ =
+        std::chrono::duration<double>(Clock::now() - loaded).count();
+  }
+
+  bool valid() const { return !pixels_.empty(); }
+
+  // Radiance arriving against the unit direction d.
+  Color radiance(Direction const& d) const { return pixels_[pixel(d)]; }
+
+  // A unit direction toward the map, with its solid angle density pdf, 0 if
+  // the map is black.
+  Direction sample(double& pdf) const {
+    double pmf;
+    size_t i = table_.sample(rand_double(), &pmf);
+    double u = (i % width_ + rand_double()) / width_;
+    double v = (i / width_ + rand_double()) / height_;
+    double theta = PI * v, phi = 2.0 * PI * (u - 0.5);
+    double sin_theta = std::sin(theta);
+    pdf = sin_theta > 0.0 ? pmf * solidAngleScale() / sin_theta : 0.0;
+    return Direction(sin_theta * std::cos(phi), std::cos(theta),
+                     sin_theta * std::sin(phi));
+  }
+
+  // Density of sample() returning the unit direction d.
+  double pdf(Direction const& d) const {
+    double sin_theta = std::sqrt(std::max(0.0, 1.0 - d.y() * d.y()));
+    if (sin_theta <= 0.0) return 0.0;
+    return table_.pmf(pixel(d)) * solidAngleScale() / sin_theta;
+  }
+
+  void printStats() const {
+    std::cerr << "environment: " << width_ << "x" << height_ << ", loaded in "
+              << load_seconds_ << " s, alias table built in "
+              << build_seconds_ << " s" << std::endl;
+  }
+
+ private:
+  size_t pixel(Direction const& d) const {
+    double u = 0.5 + std::atan2(d.z(), d.x()) / (2.0 * PI);
+    double v = std::acos(std::clamp(d.y(), -1.0, 1.0)) / PI;
+    int x = std::clamp(static_cast<int>(u * width_), 0, width_ - 1);
+    int y = std::clamp(static_cast<int>(v * height_), 0, height_ - 1);
+    return static_cast<size_t>(y) * width_ + x;
+  }
+
+  // Pixels per unit of sin(theta) times solid angle.
+  double solidAngleScale() const {
+    return static_cast<double>(width_) * height_ / (2.0 * PI * PI);
+  }
+
+  int width_ = 0, height_ = 0;
+  std::vector<Color> pixels_;
+  AliasTable table_;
+  double load_seconds_ = 0.0, build_seconds_ = 0.0;
+};
+
+#endif
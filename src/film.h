@@ -0,0 +1,139 @@
+#ifndef FILM_H
+#define FILM_H
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "vec3.h"
+
+// Per-pixel color sums that any thread may add to at any pixel, for
+// contributions that land on pixels other than the one being rendered.
+class SplatBuffer {
+ public:
+  SplatBuffer(int width, int height)
+      : width_(width), rgb_(3 * width * height) {
+    for (std::atomic<float>& channel : rgb_) channel.store(0.0f);
+  }
+
+  void splat(int h, int w, Color const& color) {
+    int index = 3 * (h * width_ + w);
+    add(rgb_[index], color.x());
+    add(rgb_[index + 1], color.y());
+    add(rgb_[index + 2], color.z());
+  }
+
+  Color get(int h, int w) const {
+    int index = 3 * (h * width_ + w);
+    return Color(rgb_[index].load(), rgb_[index + 1].load(),
+                 rgb_[index + 2].load());
+  }
+
+ private:
+  // std::atomic<float>::fetch_add is C++20.
+  static void add(std::atomic<float>& target, float value) {
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value,
+                                         std::memory_order_relaxed)) {
+    }
+  }
+
+  int width_;
+  std::vector<std::atomic<float>> rgb_;
+};
+
+// Running per-pixel sums of independent samples: their color, and their
+// luminance and its square for the variance of the mean. Each pixel must
+// only be added to by one thread at a time.
+class Film {
+ public:
+  Film(int width, int height)
+      : width_(width), pixels_(static_cast<size_t>(width) * height) {}
+
+  void add(int h, int w, Color const& color) {
+    Pixel& pixel = pixels_[h * width_ + w];
+    double y = luminance(color);
+    pixel.sum_ += color;
+    pixel.luminance_ += y;
+    pixel.luminance_squared_ += y * y;
+    pixel.samples_++;
+  }
+
+  int samples(int h, int w) const { return pixels_[h * width_ + w].samples_; }
+
+  Color mean(int h, int w) const {
+    Pixel const& pixel = pixels_[h * width_ + w];
+    if (pixel.samples_ == 0) return Color(0, 0, 0);
+    return pixel.sum_ / static_cast<float>(pixel.samples_);
+  }
+
+  // The estimated variance of the mean luminance, 0 below 2 samples.
+  double variance(int h, int w) const {
+    Pixel const& pixel = pixels_[h * width_ + w];
+    int n = pixel.samples_;
+    if (n < 2) return 0.0;
+    double mean = pixel.luminance_ / n;
+    return std::max(0.0, (pixel.luminance_squared_ - n * mean * mean) /
+                             (n - 1)) /
+           n;
+  }
+
+  // Half width of the 95% confidence interval of the mean luminance,
+  // relative to the mean, or to 1e-3 for darker pixels so that their
+  // invisible noise doesn't count as large. INF below 2 samples.
+  double relativeError(int h, int w) const {
+    Pixel const& pixel = pixels_[h * width_ + w];
+    int n = pixel.samples_;
+    if (n < 2) return INF;
+    return 1.96 * std::sqrt(variance(h, w)) /
+           std::max(pixel.luminance_ / n, 1e-3);
+  }
+
+  // The sums in binary, for checkpoints, and read back into a film of the
+  // same size. read returns false, leaving the film in an unspecified
+  // state, if the input is too short.
+  void write(std::ostream& out) const {
+    for (Pixel const& pixel : pixels_) {
+      float rgb[3] = {pixel.sum_.x(), pixel.sum_.y(), pixel.sum_.z()};
+      out.write(reinterpret_cast<char const*>(rgb), sizeof(rgb));
+      put(out, pixel.luminance_);
+      put(out, pixel.luminance_squared_);
+      put(out, pixel.samples_);
+    }
+  }
+  bool read(std::istream& in) {
+    for (Pixel& pixel : pixels_) {
+      float rgb[3];
+      in.read(reinterpret_cast<char*>(rgb), sizeof(rgb));
+      pixel.sum_ = Color(rgb[0], rgb[1], rgb[2]);
+      get(in, pixel.luminance_);
+      get(in, pixel.luminance_squared_);
+      get(in, pixel.samples_);
+    }
+    return static_cast<bool>(in);
+  }
+
+ private:
+  struct Pixel {
+    Color sum_ = Color(0, 0, 0);
+    double luminance_ = 0.0;
+    double luminance_squared_ = 0.0;
+    int samples_ = 0;
+  };
+
+  template <typename T>
+  static void put(std::ostream& out, T value) {
+    out.write(reinterpret_cast<char const*>(&value), sizeof(value));
+  }
+  template <typename T>
+  static void get(std::istream& in, T& value) {
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+  }
+
+  int width_;
+  std::vector<Pixel> pixels_;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef GRADIENT_DOMAIN_H
+#define GRADIENT_DOMAIN_H
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "camera.h"
+#include "parallel.h"
+#include "poisson.h"
+#include "world.h"
+
+// Records the random numbers of a base path and plays them back for its
+// offset paths, drawing fresh numbers once an offset path outlasts them.
+class ReplaySource : public RandomSource {
+ public:
+  // Start a new base path.
+  void reset() {
+    values_.clear();
+    next_ = 0;
+  }
+  // Start an offset path of the last base path.
+  void replay() { next_ = 0; }
+
+  double next() override {
+    if (next_ == values_.size()) values_.push_back(rand() / (RAND_MAX + 1.0));
+    return values_[next_++];
+  }
+
+ private:
+  std::vector<double> values_;
+  size_t next_ = 0;
+};
+
+// Gradient-domain path tracing (Kettunen et al. 2015). Each sample traces a
+// base path through its pixel and, with the same random numbers, offset
+// paths through the 4 neighboring pixels: the random replay shift, whose
+// Jacobian is 1 because pixels differ by a translation of the image plane.
+// Each difference between neighbors is estimated from both sides with equal
+// weight, and the image is reconstructed from these gradients and the base
+// paths by a screened Poisson solve. Smooth regions such as the ground and
+// the sky have small, low-variance gradients.
+struct GradientDomain {
+  static void render(Camera& camera, Image& image) {
+    Options const& options = Options::get();
+    int n = IMAGE_W * IMAGE_H;
+    // Per pixel: the base paths, and the differences to the right, left, up
+    // and down neighbors, each the neighbor's offset path minus the base.
+    std::vector<Color> primal(n), right(n), left(n), up(n), down(n);
+    parallelRows(IMAGE_H, [&](int h) {
+      ReplaySource source;
+      random_source = &source;
+      for (int w = 0; w < IMAGE_W; w++) {
+        int i = h * IMAGE_W + w;
+        for (int s = 0; s < options.gradient_spp; s++) {
+          source.reset();
+          Color base = trace(camera, h, w);
+          primal[i] += base;
+          if (w + 1 < IMAGE_W) {
+            source.replay();
+            right[i] += trace(camera, h, w + 1) - base;
+          }
+          if (w > 0) {
+            source.replay();
+            left[i] += trace(camera, h, w - 1) - base;
+          }
+          if (h + 1 < IMAGE_H) {
+            source.replay();
+            up[i] += trace(camera, h + 1, w) - base;
+          }
+          if (h > 0) {
+            source.replay();
+            down[i] += trace(camera, h - 1, w) - base;
+          }
+        }
+      }
+      random_source = nullptr;
+      std::cerr << h << ", " << std::endl;
+    });
+
+    ScreenedPoisson solver(IMAGE_W, IMAGE_H, options.gradient_alpha);
+    float spp = options.gradient_spp;
+    for (int c = 0; c < 3; c++) {
+      std::vector<double> p(n), gx(n), gy(n);
+      for (int i = 0; i < n; i++) {
+        p[i] = channel(primal[i], c) / spp;
+        // x(w + 1) - x(w) from pixel w going right and pixel w + 1 going
+        // left, and likewise vertically.
+        if ((i + 1) % IMAGE_W != 0) {
+          gx[i] = 0.5 * (channel(right[i], c) - channel(left[i + 1], c)) / spp;
+        }
+        if (i + IMAGE_W < n) {
+          gy[i] =
+              0.5 * (channel(up[i], c) - channel(down[i + IMAGE_W], c)) / spp;
+        }
+      }
+      std::vector<double> x =
+          solver.solve(p, gx, gy, options.poisson_iterations);
+      for (int i = 0; i < n; i++) {
+        Color& pixel = image[i / IMAGE_W][i % IMAGE_W];
+        float value = std::max(0.0, x[i]);
+        pixel = Color(c == 0 ? value : pixel.x(), c == 1 ? value : pixel.y(),
+                      c == 2 ? value : pixel.z());
+      }
+    }
+  }
+
+ private:
+  // A path through pixel (h, w) with a box filter two pixels wide. Pixels on
+  // the border look slightly past the image, so that every pixel and its
+  // shifts sample the same footprint.
+  static Color trace(Camera const& camera, int h, int w) {
+    double dx = (w + rand_double(-1, 1)) / (IMAGE_W - 1);
+    double dy = (h + rand_double(-1, 1)) / (IMAGE_H - 1);
+    return World::traceRay(camera.emitRay(dx, dy, camera.sampleLens()), 0);
+  }
+
+  static double channel(Color const& color, int c) {
+    return c == 0 ? color.x() : c == 1 ? color.y() : color.z();
+  }
+};
+
+#endif
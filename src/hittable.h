@@ -5,14 +5,19 @@
 
 #include "ray.h"
 
+class Hittable;
 class Material;
 
 struct HitRecord {
   Point p_;
   Direction normal_;
-  double t_;
-  bool front_face_;
+  double t_ = 0.0;
+  bool front_face_ = false;
   std::shared_ptr<Material> material_;
+  // The primitive that was hit.
+  Hittable const* hittable_ = nullptr;
+  // Mip level textures are read at here, see Texture::getColorAtLevel.
+  int texture_level_ = 0;
   // set the normal vector to point against the ray for convenience of coloring.
   void setFaceNormal(Ray const& ray, Direction outward_normal) {
     front_face_ = dot(ray.direction(), outward_normal) < 0;
@@ -47,6 +52,14 @@ class HittableList : public Hittable {
     }
     return hit_any;
   }
+  // Any-hit query for shadow rays: stop at the first hit in (t_min, t_max).
+  bool occluded(Ray const& ray, double t_min, double t_max) const {
+    HitRecord temp_record;
+    for (auto const& hittable : hittables) {
+      if (hittable->hit(ray, t_min, t_max, temp_record)) return true;
+    }
+    return false;
+  }
   void addHittable(std::unique_ptr<Hittable>&& hittable) {
     hittables.push_back(std::move(hittable));
   }
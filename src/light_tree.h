@@ -0,0 +1,218 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+#include "sphere.h"
+
+// The set of directions within angle acos(cos_theta_) of w_. cos_theta_ == -1
+// covers the whole sphere.
+struct DirectionCone {
+  Direction w_ = Direction(0, 0, 1);
+  double cos_theta_ = -1.0;
+
+  static DirectionCone all() { return DirectionCone(); }
+
+  static DirectionCone merge(DirectionCone const& a, DirectionCone const& b) {
+    double theta_a = acos(std::clamp(a.cos_theta_, -1.0, 1.0));
+    double theta_b = acos(std::clamp(b.cos_theta_, -1.0, 1.0));
+    double theta_d = acos(std::clamp(dot(a.w_, b.w_), -1.0, 1.0));
+    // One cone already contains the other.
+    if (std::min(theta_d + theta_b, PI) <= theta_a) return a;
+    if (std::min(theta_d + theta_a, PI) <= theta_b) return b;
+    double theta_o = (theta_a + theta_d + theta_b) / 2.0;
+    if (theta_o >= PI) return all();
+    // Rotate a's axis toward b's until the cone spans both.
+    double theta_r = theta_o - theta_a;
+    Direction axis = cross(a.w_, b.w_);
+    if (axis.lenSquared() < 1e-12) return all();
+    axis = axis.normalize();
+    Direction w = a.w_ * cos(theta_r) + cross(axis, a.w_) * sin(theta_r) +
+                  axis * dot(axis, a.w_) * (1.0 - cos(theta_r));
+    return DirectionCone{w.normalize(), cos(theta_o)};
+  }
+};
+
+// Conservative summary of a set of emitters: where they are, which way they
+// emit, and how much they emit in total.
+struct LightBounds {
+  Aabb bounds_;
+  DirectionCone normals_;
+  // Half-angle bound of emission around any normal, PI / 2 for diffuse.
+  double cos_theta_e_ = 0.0;
+  double power_ = 0.0;
+
+  static LightBounds merge(LightBounds const& a, LightBounds const& b) {
+    if (a.power_ <= 0.0) return b;
+    if (b.power_ <= 0.0) return a;
+    LightBounds merged = a;
+    merged.bounds_.grow(b.bounds_);
+    merged.normals_ = DirectionCone::merge(a.normals_, b.normals_);
+    merged.cos_theta_e_ = std::min(a.cos_theta_e_, b.cos_theta_e_);
+    merged.power_ += b.power_;
+    return merged;
+  }
+
+  // Estimate of how much these emitters contribute at p, following the bound
+  // of Conty Estevez and Kulla. normal is null for points in the fog, where
+  // light arrives from all directions.
+  double importance(Point const& p, Direction const* normal) const {
+    Point center = bounds_.center();
+    Direction to_p = p - center;
+    double d2 = to_p.lenSquared();
+    double half_diagonal_squared = bounds_.diagonal().lenSquared() / 4.0;
+    double sin_b_squared = half_diagonal_squared / std::max(d2, 1e-12);
+    // p inside the bounding sphere sees emitters in every direction.
+    bool inside = sin_b_squared >= 1.0;
+    double theta_b = inside ? PI : asin(sqrt(sin_b_squared));
+    d2 = std::max(d2, half_diagonal_squared);
+
+    double theta_w = d2 > 0.0 ? acos(std::clamp(
+                                    dot(normals_.w_, to_p.normalize()), -1.0,
+                                    1.0))
+                              : 0.0;
+    double theta_o = acos(std::clamp(normals_.cos_theta_, -1.0, 1.0));
+    double theta_x = std::max(0.0, theta_w - theta_o - theta_b);
+    double cos_theta_x = theta_x >= PI ? -1.0 : cos(theta_x);
+    if (cos_theta_x <= cos_theta_e_) return 0.0;
+    double result = power_ * cos_theta_x / d2;
+
+    if (normal && !inside) {
+      double theta_i = acos(std::clamp(dot(*normal, -to_p.normalize()),
+                                       -1.0, 1.0));
+      double theta_ip = std::max(0.0, theta_i - theta_b);
+      if (theta_ip >= PI / 2.0) return 0.0;
+      result *= cos(theta_ip);
+    }
+    return result;
+  }
+
+  // A sphere emits from every outward normal, each over a hemisphere.
+  static LightBounds ofSphere(Sphere const& sphere) {
+    LightBounds result;
+    Direction extent(sphere.radius(), sphere.radius(), sphere.radius());
+    result.bounds_ = Aabb(sphere.center() - extent, sphere.center() + extent);
+    result.normals_ = DirectionCone::all();
+    result.cos_theta_e_ = 0.0;
+    result.power_ = sphere.material()->power() * 4.0 * PI * PI *
+                    sphere.radius() * sphere.radius();
+    return result;
+  }
+};
+
+// Bounding volume hierarchy over emissive spheres. Sampling walks from the
+// root and picks a child with probability proportional to its importance at
+// the shading point, so that the selected light is roughly proportional to
+// its contribution there, in O(log n).
+class LightTree {
+ public:
+  void build(std::vector<Sphere const*> const& lights) {
+    nodes_.clear();
+    bit_trails_.assign(lights.size(), 0);
+    if (lights.empty()) return;
+    std::vector<std::pair<size_t, LightBounds>> items;
+    for (size_t i = 0; i < lights.size(); i++) {
+      items.emplace_back(i, LightBounds::ofSphere(*lights[i]));
+    }
+    buildRecursive(items, 0, items.size(), 0, 0);
+  }
+
+  bool empty() const { return nodes_.empty(); }
+
+  // Return the index of the sampled light and its probability in pmf.
+  size_t sample(Point const& p, Direction const* normal, double u,
+                double& pmf) const {
+    pmf = 1.0;
+    size_t node = 0;
+    while (!nodes_[node].leaf_) {
+      size_t left = node + 1, right = nodes_[node].child_or_light_;
+      double importance[2] = {nodes_[left].bounds_.importance(p, normal),
+                              nodes_[right].bounds_.importance(p, normal)};
+      double total = importance[0] + importance[1];
+      if (total <= 0.0) {
+        pmf = 0.0;
+        return 0;
+      }
+      double p_left = importance[0] / total;
+      // Reuse u for the next level after remapping it to [0, 1).
+      if (u < p_left) {
+        u = std::min(u / p_left, 1.0 - 1e-12);
+        pmf *= p_left;
+        node = left;
+      } else {
+        u = std::min((u - p_left) / (1.0 - p_left), 1.0 - 1e-12);
+        pmf *= 1.0 - p_left;
+        node = right;
+      }
+    }
+    return nodes_[node].child_or_light_;
+  }
+
+  // Probability that sample() returns light at p.
+  double pmf(Point const& p, Direction const* normal, size_t light) const {
+    double pmf = 1.0;
+    size_t node = 0;
+    uint64_t trail = bit_trails_[light];
+    while (!nodes_[node].leaf_) {
+      size_t left = node + 1, right = nodes_[node].child_or_light_;
+      double importance[2] = {nodes_[left].bounds_.importance(p, normal),
+                              nodes_[right].bounds_.importance(p, normal)};
+      double total = importance[0] + importance[1];
+      if (total <= 0.0) return 0.0;
+      int go_right = trail & 1;
+      pmf *= importance[go_right] / total;
+      node = go_right ? right : left;
+      trail >>= 1;
+    }
+    return pmf;
+  }
+
+ private:
+  // Nodes are stored depth first: a left child directly follows its parent,
+  // the right child is at child_or_light_. Leaves hold a light index instead.
+  struct Node {
+    LightBounds bounds_;
+    size_t child_or_light_;
+    bool leaf_;
+  };
+
+  size_t buildRecursive(std::vector<std::pair<size_t, LightBounds>>& items,
+                        size_t begin, size_t end, uint64_t trail, int depth) {
+    size_t index = nodes_.size();
+    nodes_.emplace_back();
+    if (end - begin == 1) {
+      nodes_[index] = Node{items[begin].second, items[begin].first, true};
+      bit_trails_[items[begin].first] = trail;
+      return index;
+    }
+    // Split at the median along the longest axis of the centroids, which
+    // keeps the tree balanced and its depth within the 64-bit trail.
+    Aabb centroids;
+    for (size_t i = begin; i < end; i++) {
+      centroids.grow(items[i].second.bounds_.center());
+    }
+    int dim = centroids.maxExtent();
+    size_t mid = (begin + end) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + mid,
+                     items.begin() + end, [dim](auto const& a, auto const& b) {
+                       return axis(a.second.bounds_.center(), dim) <
+                              axis(b.second.bounds_.center(), dim);
+                     });
+    buildRecursive(items, begin, mid, trail, depth + 1);
+    size_t right = buildRecursive(items, mid, end,
+                                  trail | (uint64_t(1) << depth), depth + 1);
+    nodes_[index] = Node{LightBounds::merge(nodes_[index + 1].bounds_,
+                                            nodes_[right].bounds_),
+                         right, false};
+    return index;
+  }
+
+  std::vector<Node> nodes_;
+  // Left/right choices from the root to each light, lowest bit first.
+  std::vector<uint64_t> bit_trails_;
+};
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef LIGHTCUTS_H
+#define LIGHTCUTS_H
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <queue>
+#include <vector>
+
+#include "camera.h"
+#include "light_tree.h"
+#include "parallel.h"
+#include "world.h"
+
+// A virtual point light: a vertex of a light subpath that lights the scene
+// with intensity_ * cos toward the directions around normal_ on a diffuse
+// surface, or in the fog with intensity_ times 4 PI times the phase function
+// for light that arrived along wi_.
+struct Vpl {
+  Point p_;
+  Direction normal_;
+  bool has_normal_;
+  Color intensity_;
+  Direction wi_;
+};
+
+// Instant radiosity with lightcuts (Walter et al. 2005), for fast previews.
+// Light subpaths from the emissive spheres leave VPLs on the emitters, at
+// diffuse vertices and in the fog. A binary tree clusters the VPLs, and each
+// shading point picks a cut through it adaptively: a cluster is shaded as
+// its representative VPL scaled to the cluster's intensity, and the cluster
+// with the largest error bound is refined until every bound is below a
+// fraction of the total. Shading costs one shadow ray per cluster in the cut,
+// which grows much slower than the VPL count.
+class Lightcuts {
+ public:
+  Lightcuts()
+      : error_(Options::get().lightcut_error),
+        max_cut_(Options::get().lightcut_max),
+        clamp_(Options::get().vpl_clamp) {
+    auto start = std::chrono::steady_clock::now();
+    int paths = Options::get().vpl_paths;
+    if (!World::emitters().empty()) {
+      for (int i = 0; i < paths; i++) tracePath(paths);
+    }
+    auto traced = std::chrono::steady_clock::now();
+    if (!vpls_.empty()) build(0, vpls_.size());
+    auto built = std::chrono::steady_clock::now();
+    std::cerr << "lightcuts: " << vpls_.size() << " VPLs from " << paths
+              << " light paths in "
+              << std::chrono::duration<double>(traced - start).count()
+              << "s, tree built in "
+              << std::chrono::duration<double>(built - traced).count() << "s"
+              << std::endl;
+  }
+
+  void render(Camera& camera, Image& image) {
+    int spp = Options::get().vpl_spp;
+    std::atomic<long long> cut_total{0}, points{0};
+    parallelRows(IMAGE_H, [&](int h) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        Color sum(0, 0, 0);
+        for (int s = 0; s < spp; s++) {
+          double dx = std::clamp((w + rand_double(-1, 1)) / (IMAGE_W - 1),
+                                 0.0, 1.0);
+          double dy = std::clamp((h + rand_double(-1, 1)) / (IMAGE_H - 1),
+                                 0.0, 1.0);
+          ShadingPoint point = World::findShadingPoint(camera.emitRay(dx, dy));
+          sum += point.emitted_;
+          if (!point.valid_ || nodes_.empty()) continue;
+          int cut_size;
+          sum += point.throughput_ * shade(point, cut_size);
+          cut_total.fetch_add(cut_size, std::memory_order_relaxed);
+          points.fetch_add(1, std::memory_order_relaxed);
+        }
+        image[h][w] = sum / static_cast<float>(spp);
+      }
+    });
+    std::cerr << "lightcuts: average cut of "
+              << (points ? double(cut_total) / points : 0.0) << " clusters"
+              << std::endl;
+  }
+
+ private:
+  struct Node {
+    LightBounds bounds_;
+    Color intensity_ = Color(0, 0, 0);
+    // The VPL that stands in for the whole cluster.
+    size_t representative_ = 0;
+    int left_ = -1, right_ = -1;
+    // Whether any of the VPLs is in the fog.
+    bool fog_ = false;
+
+    bool leaf() const { return left_ < 0; }
+  };
+
+  // A cluster in the cut, with its error bound and estimate.
+  struct Cluster {
+    double bound_;
+    int node_;
+    // Light from the representative per unit of intensity.
+    Color unit_;
+
+    bool operator<(Cluster const& other) const {
+      return bound_ < other.bound_;
+    }
+  };
+
+  void deposit(Point const& p, Direction const* normal,
+               Color const& intensity, Direction const& wi = Direction()) {
+    if (luminance(intensity) <= 0.0) return;
+    vpls_.push_back(Vpl{p, normal ? *normal : Direction(), normal != nullptr,
+                        intensity, wi});
+  }
+
+  // One of paths light subpaths, through the fog as camera paths see it.
+  void tracePath(int paths) {
+    double pmf;
+    Sphere const& light = *World::emitters()[World::samplePowerLight(pmf)];
+    Direction normal = Direction::rand_unit_vec();
+    HitRecord emitter;
+    emitter.p_ = light.center() + light.radius() * normal;
+    emitter.normal_ = normal;
+    emitter.front_face_ = true;
+    double area = 4.0 * PI * light.radius() * light.radius();
+    Color radiance = light.material()->emit(emitter);
+    // Radiance times the area each path stands for.
+    deposit(emitter.p_, &normal,
+            radiance * static_cast<float>(area / (pmf * paths)));
+    // Cosine distributed emission, so the cosine and PI cancel the density.
+    Color beta = radiance * static_cast<float>(PI * area / (pmf * paths));
+    Ray ray(emitter.p_, (normal + Direction::rand_unit_vec()).normalize());
+    for (int bounce = 0; bounce < Options::get().vpl_max_depth; bounce++) {
+      HitRecord hit_record;
+      if (!World::intersect(ray, hit_record)) return;
+      Ray scattered;
+      double t = World::sampleFog(ray, scattered, hit_record.t_);
+      if (hit_record.t_ > t) {
+        beta *= World::medium().albedo_;
+        deposit(scattered.origin(), nullptr,
+                beta * static_cast<float>(1.0 / (4.0 * PI)),
+                ray.direction().normalize());
+        ray = scattered;
+        continue;
+      }
+      Material const& material = *hit_record.material_;
+      if (material.isEmissive()) return;
+      if (material.isDiffuse()) {
+        // Radiance albedo / PI times the incident power.
+        deposit(hit_record.p_, &hit_record.normal_,
+                beta * material.eval(ray, hit_record, hit_record.normal_));
+      }
+      Color attenuation;
+      if (!material.scatter(ray, hit_record, attenuation, scattered)) return;
+      beta = beta * attenuation;
+      ray = Ray(scattered.origin(), scattered.direction().normalize());
+    }
+  }
+
+  // Build the subtree over vpls_[begin, end) and return its index.
+  int build(size_t begin, size_t end) {
+    int index = nodes_.size();
+    nodes_.emplace_back();
+    if (end - begin == 1) {
+      Vpl const& vpl = vpls_[begin];
+      Node& node = nodes_[index];
+      node.bounds_.bounds_ = Aabb(vpl.p_, vpl.p_);
+      node.bounds_.normals_ = vpl.has_normal_ ? DirectionCone{vpl.normal_, 1.0}
+                                              : DirectionCone::all();
+      node.bounds_.cos_theta_e_ = vpl.has_normal_ ? 0.0 : -1.0;
+      node.bounds_.power_ = luminance(vpl.intensity_);
+      node.intensity_ = vpl.intensity_;
+      node.representative_ = begin;
+      node.fog_ = !vpl.has_normal_;
+      return index;
+    }
+    Aabb centers;
+    for (size_t i = begin; i < end; i++) centers.grow(vpls_[i].p_);
+    int dim = centers.maxExtent();
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(vpls_.begin() + begin, vpls_.begin() + mid,
+                     vpls_.begin() + end, [dim](Vpl const& a, Vpl const& b) {
+                       return axis(a.p_, dim) < axis(b.p_, dim);
+                     });
+    int left = build(begin, mid);
+    int right = build(mid, end);
+    Node& node = nodes_[index];
+    node.left_ = left;
+    node.right_ = right;
+    node.bounds_ =
+        LightBounds::merge(nodes_[left].bounds_, nodes_[right].bounds_);
+    node.intensity_ = nodes_[left].intensity_ + nodes_[right].intensity_;
+    node.fog_ = nodes_[left].fog_ || nodes_[right].fog_;
+    // Pick the representative in proportion to intensity, as Walter et al.
+    double p_left = nodes_[left].bounds_.power_ / node.bounds_.power_;
+    node.representative_ = rand_double() < p_left
+                               ? nodes_[left].representative_
+                               : nodes_[right].representative_;
+    return index;
+  }
+
+  // Light from vpl at point per unit of intensity.
+  Color unitContribution(ShadingPoint const& point, Vpl const& vpl) const {
+    Direction wi = vpl.p_ - point.p();
+    double dist_squared = wi.lenSquared();
+    if (dist_squared <= 1e-12) return Color(0, 0, 0);
+    double dist = sqrt(dist_squared);
+    wi = wi / dist;
+    double g = 1.0 / dist_squared;
+    if (vpl.has_normal_) {
+      g *= std::max(0.0, -dot(vpl.normal_, wi));
+    } else {
+      g *= 4.0 * PI * World::medium().phase(vpl.wi_, -wi);
+    }
+    if (clamp_ > 0.0) g = std::min(g, clamp_);
+    double pdf;
+    Color f = point.eval(wi, pdf);
+    if (g <= 0.0 || (f.x() <= 0 && f.y() <= 0 && f.z() <= 0) ||
+        World::occluded(point.p(), vpl.p_)) {
+      return Color(0, 0, 0);
+    }
+    return f * static_cast<float>(
+                   g * World::fogTransmittance(Ray(point.p(), wi), dist));
+  }
+
+  // Bound of the light node can send to point. LightBounds::importance
+  // bounds the cosines at both ends, but divides by the squared distance to
+  // the center of the box, which is replaced by the distance to the box.
+  // It treats VPLs in the fog as isotropic, so clusters with any are scaled
+  // by how far the phase function peaks above isotropic.
+  double bound(ShadingPoint const& point, Node const& node,
+               double material_bound) const {
+    LightBounds const& bounds = node.bounds_;
+    double importance = bounds.importance(point.p(), point.normal());
+    if (importance <= 0.0) return 0.0;
+    Aabb const& box = bounds.bounds_;
+    double center_squared =
+        std::max((point.p() - box.center()).lenSquared(),
+                 box.diagonal().lenSquared() / 4.0);
+    double dist_squared = box.distanceSquared(point.p());
+    double g = dist_squared > 0.0 ? importance * center_squared / dist_squared
+                                  : INF;
+    if (node.fog_) g *= std::max(1.0, 4.0 * PI * World::medium().maxPhase());
+    if (clamp_ > 0.0) g = std::min(g, clamp_ * bounds.power_);
+    return material_bound * g;
+  }
+
+  Color shade(ShadingPoint const& point, int& cut_size) const {
+    // BSDF bound: exact for Lambertian surfaces, where it peaks along the
+    // normal, and the fog. Fuzzy Metal peaks without limit toward the edge
+    // of its lobe, so it has no finite bound and its cut is refined up to
+    // lightcut_max.
+    double pdf;
+    Direction const* normal = point.normal();
+    double material_bound = World::medium().maxPhase();
+    if (normal) {
+      material_bound = point.hit_record_.material_->isDiffuse()
+                           ? luminance(point.eval(*normal, pdf))
+                           : INF;
+    }
+
+    std::priority_queue<Cluster> cut;
+    Node const& root = nodes_[0];
+    Color unit = unitContribution(point, vpls_[root.representative_]);
+    Color total = unit * root.intensity_;
+    if (!root.leaf()) {
+      cut.push(Cluster{bound(point, root, material_bound), 0, unit});
+    }
+    cut_size = 1;
+    while (!cut.empty() && cut_size < max_cut_ &&
+           cut.top().bound_ > error_ * luminance(total)) {
+      Cluster cluster = cut.top();
+      cut.pop();
+      Node const& node = nodes_[cluster.node_];
+      total -= cluster.unit_ * node.intensity_;
+      for (int child : {node.left_, node.right_}) {
+        Node const& child_node = nodes_[child];
+        // One child shares the representative, and its shadow ray.
+        Color child_unit =
+            child_node.representative_ == node.representative_
+                ? cluster.unit_
+                : unitContribution(point, vpls_[child_node.representative_]);
+        total += child_unit * child_node.intensity_;
+        if (!child_node.leaf()) {
+          cut.push(Cluster{bound(point, child_node, material_bound), child,
+                           child_unit});
+        }
+      }
+      cut_size++;
+    }
+    return total;
+  }
+
+  double error_;
+  int max_cut_;
+  double clamp_;
+  std::vector<Vpl> vpls_;
+  std::vector<Node> nodes_;
+};
+
+#endif
@@ -1,43 +1,247 @@
+#include <chrono>
+#include <cmath>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <vector>
 
+#include "adaptive.h"
+#include "bdpt.h"
 #include "camera.h"
+#include "caustics.h"
+#include "denoiser.h"
+#include "gradient_domain.h"
+#include "lightcuts.h"
+#include "parallel.h"
+#include "path_guiding.h"
+#include "preview.h"
+#include "progressive.h"
+#include "pssmlt.h"
+#include "restir.h"
+#include "upsampler.h"
 
-int main() {
+using Clock = std::chrono::steady_clock;
+
+double seconds(Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+// Write the AOVs of aovs from framebuffer, and resolve film into image, or
+// with denoise filter it with an AtrousDenoiser guided by framebuffer.
+void finishImage(Film const& film, AovFramebuffer const* framebuffer,
+                 unsigned aovs, Image& image) {
+  if (aovs) framebuffer->write(aovs);
+  if (Options::get().denoise) {
+    auto denoiser = std::make_unique<AtrousDenoiser>();
+    denoiser->setFeatures(*framebuffer);
+    denoiser->denoise(film, image);
+    denoiser->printStats();
+  } else {
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) image[h][w] = film.mean(h, w);
+    }
+  }
+}
+
+// Path trace SAMPLE_RATE ^ 2 samples for each pixel, in passes of pass_spp
+// samples, writing the image so far to world.ppm after the first pass and
+// then at most every snapshot_interval seconds. With primary splitting,
+// paths share camera rays, and the rate drops to the even number closest to
+// SAMPLE_RATE / sqrt(split). With a time_budget, a first pass of one sample
+// measures the speed, and each pass after it is cut to the samples that the
+// slowest time per sample so far says end, leaving time to write the image,
+// before the deadline. The paths record the AOVs asked for, written out at
+// the end, and with denoise those an AtrousDenoiser filters the image with;
+// with a time_budget, both are done once after the first pass too, to time
+// them.
+void renderPaths(Camera& camera, Image& image, Clock::time_point start) {
+  Options const& options = Options::get();
+  int split = std::max(1, options.primary_split);
+  int rate = std::max(
+      2, 2 * static_cast<int>(std::lround(SAMPLE_RATE / (2 * sqrt(split)))));
+  unsigned aovs = parseAovs(options.aovs);
+  unsigned features = options.denoise ? AOV_NORMAL | AOV_ALBEDO | AOV_DEPTH : 0;
+  ProgressiveRenderer renderer(camera, rate, aovs | features);
+  if (options.resume && renderer.resume(options.checkpoint)) {
+    std::cerr << "resuming at " << renderer.samples() << " spp from "
+              << options.checkpoint << std::endl;
+  }
+  auto last_snapshot = Clock::now(), last_checkpoint = Clock::now();
+  // Seconds per sample per pixel, and to write an image.
+  double per_sample = 0.0, write_time = 0.0;
+  int first = renderer.samples(), checkpointed = renderer.samples();
+  auto finish = [&]() {
+    finishImage(renderer.film(), renderer.aovs(), aovs, image);
+  };
+  for (int pass = 0; renderer.samples() < renderer.total(); pass++) {
+    int count = std::max(1, options.pass_spp);
+    if (options.time_budget > 0.0) {
+      double left = options.time_budget - seconds(Clock::now() - start) -
+                    write_time;
+      if (pass == 0) {
+        count = 1;
+      } else if (left < per_sample) {
+        break;
+      } else {
+        count = std::min(count, static_cast<int>(left / per_sample));
+      }
+    }
+    auto pass_start = Clock::now();
+    renderer.renderPass(count);
+    per_sample =
+        std::max(per_sample, seconds(Clock::now() - pass_start) / count);
+    std::cerr << "pass " << pass + 1 << ": " << renderer.samples() << " of "
+              << renderer.total() << " spp" << std::endl;
+    if (pass == 0 && options.time_budget > 0.0 && (aovs || options.denoise)) {
+      auto finish_start = Clock::now();
+      finish();
+      write_time += seconds(Clock::now() - finish_start);
+    }
+    bool done = renderer.samples() == renderer.total();
+    if (!done && (pass == 0 || seconds(Clock::now() - last_snapshot) >=
+                                   options.snapshot_interval)) {
+      auto snapshot_start = Clock::now();
+      renderer.snapshot("world.ppm");
+      last_snapshot = Clock::now();
+      write_time =
+          std::max(write_time, seconds(last_snapshot - snapshot_start));
+    }
+    if (options.checkpoint_interval > 0.0 &&
+        (done || seconds(Clock::now() - last_checkpoint) >=
+                     options.checkpoint_interval)) {
+      renderer.checkpoint(options.checkpoint);
+      last_checkpoint = Clock::now();
+      checkpointed = renderer.samples();
+    }
+  }
+  // The time budget can end the passes early.
+  if (options.checkpoint_interval > 0.0 &&
+      checkpointed != renderer.samples()) {
+    renderer.checkpoint(options.checkpoint);
+  }
+  if (options.time_budget > 0.0) {
+    std::cerr << "time budget: " << renderer.samples() - first << " spp in "
+              << seconds(Clock::now() - start) << " s" << std::endl;
+  }
+  finish();
+}
+
+// Path trace with adaptive sampling, see adaptive.h, storing each pixel's
+// sample count into counts. As with renderPaths, the paths record the AOVs
+// asked for, written out at the end, and with denoise those an
+// AtrousDenoiser filters the image with.
+void renderAdaptive(Camera& camera, Image& image, std::vector<int>& counts) {
+  unsigned aovs = parseAovs(Options::get().aovs);
+  unsigned features =
+      Options::get().denoise ? AOV_NORMAL | AOV_ALBEDO | AOV_DEPTH : 0;
+  Film film(IMAGE_W, IMAGE_H);
+  std::unique_ptr<AovFramebuffer> framebuffer;
+  if (aovs | features) {
+    framebuffer =
+        std::make_unique<AovFramebuffer>(IMAGE_W, IMAGE_H, aovs | features);
+  }
+  AdaptiveSampling::render(camera, film, framebuffer.get(), counts);
+  finishImage(film, framebuffer.get(), aovs, image);
+}
+
+// A preview of one color per preview_upsample x preview_upsample block of
+// pixels, upsampled to full resolution by a JointBilateralUpsampler, with
+// the time each stage takes.
+void renderUpsampledPreview(Camera& camera, Image& image, Integrator mode) {
+  auto start = Clock::now();
+  JointBilateralUpsampler upsampler(Options::get().preview_upsample);
+  upsampler.traceGuides(camera);
+  auto traced = Clock::now();
+  std::vector<Color> blocks;
+  Preview::renderBlocks(camera, upsampler.factor(), mode, blocks);
+  auto rendered = Clock::now();
+  upsampler.upsample(blocks, image);
+  std::cerr << "preview: guides traced in " << seconds(traced - start)
+            << " s, " << upsampler.width() << "x" << upsampler.height()
+            << " rendered in " << seconds(rendered - traced)
+            << " s, upsampled in " << seconds(Clock::now() - rendered)
+            << " s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  auto start = Clock::now();
+  Options::get().parse(argc, argv);
+  std::unique_ptr<EnvironmentMap> environment;
+  if (!Options::get().envmap.empty()) {
+    environment = std::make_unique<EnvironmentMap>(
+        Options::get().envmap.c_str(), Options::get().envmap_scale);
+    if (environment->valid()) Background::setEnvironment(environment.get());
+  }
   World::init();
+  PhotonMap caustics = Caustics::build(Options::get().caustic_photons);
+  if (caustics.size() > 0) World::setCaustics(&caustics);
+  double quality = Options::get().radiance_cache_quality;
+  RadianceCache radiance_cache(0.1 / quality,
+                               static_cast<int>(std::ceil(16 * quality)));
+  if (Options::get().radiance_cache) World::setRadianceCache(&radiance_cache);
   Image image;
+  std::vector<int> sample_counts;
   Camera camera(Point(15, 2, 3), Point(0, 0, 0), Direction(0, 1, 0), 30,
                 ASPECT_RATIO, 0.04);
-  // Divide the workload and spawn multiple threads to handle it.
-  // TODO(chaoqin-li1123): Use GPU for parallelism.
-  int thread_cnt = std::thread::hardware_concurrency();
-  int h_interval = IMAGE_H / thread_cnt;
-  auto func = [&](int h0, int h1) {
-    for (int h = h0; h < IMAGE_H && h <= h1; h++) {
-      for (int w = 0; w < IMAGE_W; w++) {
-        Color accumulated = Color(0, 0, 0);
-        int samples_cnt = 0;
-        // Take SAMPLE_RATE ^ 2 samples for each pixel for anti-aliasing.
-        for (int i = -SAMPLE_RATE / 2; i < SAMPLE_RATE / 2; i++) {
-          for (int j = -SAMPLE_RATE / 2; j < SAMPLE_RATE / 2; j++) {
-            constexpr double SAMPLE_INTERVAL = 2.0 / SAMPLE_RATE;
-            double dx = (w + i * SAMPLE_INTERVAL) / (IMAGE_W - 1);
-            double dy = (h + j * SAMPLE_INTERVAL) / (IMAGE_H - 1);
-            if (dx < 0.0 || dx > 1.0 || dy < 0.0 || dy > 1.0) continue;
-            Ray r = camera.emitRay(dx, dy);
-            accumulated += World::traceRay(r, 0);
-            samples_cnt++;
-          }
-        }
-        image[h][w] = accumulated / (float)samples_cnt;
+  Integrator mode = Options::get().integrator;
+  if (mode != Integrator::PATH && !Options::get().aovs.empty()) {
+    std::cerr << INTEGRATOR_NAMES[static_cast<int>(mode)] << " ignores --aovs"
+              << std::endl;
+  }
+  if (mode != Integrator::PATH && Options::get().denoise) {
+    std::cerr << INTEGRATOR_NAMES[static_cast<int>(mode)]
+              << " ignores --denoise" << std::endl;
+  }
+  if (mode != Integrator::ALBEDO && mode != Integrator::AO &&
+      mode != Integrator::DIRECT && Options::get().preview_upsample > 1) {
+    std::cerr << INTEGRATOR_NAMES[static_cast<int>(mode)]
+              << " ignores --preview_upsample" << std::endl;
+  }
+  switch (mode) {
+    case Integrator::PATH:
+      if (Options::get().target_error > 0.0) {
+        renderAdaptive(camera, image, sample_counts);
+      } else {
+        renderPaths(camera, image, start);
       }
-      std::cerr << h << ", " << std::endl;
-    }
-  };
-  std::vector<std::thread> threads;
-  for (int i = 0; i * h_interval < IMAGE_H; i++) {
-    threads.emplace_back(func, i * h_interval, (i + 1) * h_interval);
+      break;
+    case Integrator::RESTIR:
+      Restir::render(camera, image);
+      break;
+    case Integrator::GUIDED:
+      PathGuiding::render(camera, image);
+      break;
+    case Integrator::BDPT:
+      if (World::fogVolume()) {
+        std::cerr << "bdpt ignores --fog_volume" << std::endl;
+      }
+      Bdpt(camera).render(image);
+      break;
+    case Integrator::LIGHTCUTS:
+      Lightcuts().render(camera, image);
+      break;
+    case Integrator::GRADIENT:
+      GradientDomain::render(camera, image);
+      break;
+    case Integrator::MLT:
+      Pssmlt::render(camera, image);
+      break;
+    case Integrator::ALBEDO:
+    case Integrator::AO:
+    case Integrator::DIRECT:
+      if (Options::get().preview_upsample > 1) {
+        renderUpsampledPreview(camera, image, mode);
+      } else {
+        Preview::render(camera, image, mode);
+      }
+      break;
   }
-  for (std::thread& thread : threads) thread.join();
+  if (caustics.size() > 0) caustics.printStats();
+  if (Options::get().radiance_cache) radiance_cache.printStats();
+  if (World::fogVolume()) World::fogVolume()->printStats();
+  if (Background::environment()) environment->printStats();
   ImagePrinter::printPpm(image, "world.ppm");
-}
\ No newline at end of file
+  if (!sample_counts.empty()) {
+    AdaptiveSampling::countImage(sample_counts, image);
+    ImagePrinter::printPpm(image, "samples.ppm");
+  }
+}
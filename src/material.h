@@ -1,5 +1,7 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <memory>
 
@@ -8,12 +10,51 @@
 
 class Material {
  public:
+  Material() : id_(created_++) {}
   virtual ~Material() = default;
+  // Distinct for every material, counting from 0 in order of creation.
+  int id() const { return id_; }
   virtual bool scatter(Ray const& ray, HitRecord const& hit_record,
                        Color& attenuation, Ray& scattered) const = 0;
   virtual Color emit(HitRecord const&) const { return Color(0, 0, 0); }
+  // The BSDF times the cosine term for scattering ray into the unit direction
+  // wo, so that attenuation == eval / pdf for the directions scatter() picks.
+  virtual Color eval(Ray const& ray, HitRecord const& hit_record,
+                     Direction const& wo) const {
+    return Color(0, 0, 0);
+  }
+  // Solid angle density of scatter() picking the unit direction wo.
+  virtual double pdf(Ray const& ray, HitRecord const& hit_record,
+                     Direction const& wo) const {
+    return 0.0;
+  }
+  // Specular materials scatter into a single direction, which eval() and pdf()
+  // can't express and light sampling can't hit.
+  virtual bool isSpecular() const { return true; }
+  // Diffuse materials reflect the same radiance in every direction, albedo
+  // times irradiance / PI.
+  virtual bool isDiffuse() const { return false; }
+  virtual bool isEmissive() const { return false; }
+  // Paths to branch into at the first vertex of a camera path, up to
+  // max_split. Rough materials, whose scattered paths vary the most, get the
+  // most.
+  virtual int split(int max_split) const { return 1; }
+  // How much scattering blurs what the path sees past this surface: 1 for
+  // diffuse, 0 for mirrors and glass.
+  virtual double roughness() const { return 0.0; }
+  // Color of the surface regardless of lighting, for previews.
+  virtual Color albedo(HitRecord const&) const { return Color(1, 1, 1); }
+  // Radiance averaged over the surface and color channels, used to pick the
+  // brighter emitters more often.
+  virtual float power() const { return 0.0f; }
+
+ private:
+  static int created_;
+  int id_;
 };
 
+int Material::created_ = 0;
+
 class Lambertian : public Material {
  public:
   virtual ~Lambertian() = default;
@@ -28,11 +69,33 @@ class Lambertian : public Material {
     }
 
     scattered = Ray(hit_record.p_, scatter_direction);
-    attenuation = texture_->getColor(hit_record.normal_);
+    attenuation = color(hit_record);
     return true;
   }
+  // normal + a uniform unit vector is cosine distributed.
+  virtual Color eval(Ray const& ray, HitRecord const& hit_record,
+                     Direction const& wo) const override {
+    return color(hit_record) * static_cast<float>(pdf(ray, hit_record, wo));
+  }
+  virtual double pdf(Ray const&, HitRecord const& hit_record,
+                     Direction const& wo) const override {
+    return std::max(0.0, dot(hit_record.normal_, wo)) / PI;
+  }
+  virtual bool isSpecular() const override { return false; }
+  virtual bool isDiffuse() const override { return true; }
+  virtual int split(int max_split) const override { return max_split; }
+  virtual double roughness() const override { return 1.0; }
+  virtual Color albedo(HitRecord const& hit_record) const override {
+    return color(hit_record);
+  }
 
  private:
+  // The texture at the hit, at the hit's level of detail.
+  Color color(HitRecord const& hit_record) const {
+    return texture_->getColorAtLevel(hit_record.normal_,
+                                     hit_record.texture_level_);
+  }
+
   std::shared_ptr<Texture> texture_;
 };
 
@@ -52,6 +115,40 @@ class Metal : public Material {
 
     return (dot(scattered.direction(), hit_record.normal_) > 0);
   }
+  // Directions below the surface are absorbed.
+  virtual Color eval(Ray const& ray, HitRecord const& hit_record,
+                     Direction const& wo) const override {
+    if (dot(wo, hit_record.normal_) <= 0) return Color(0, 0, 0);
+    return albedo_ * static_cast<float>(pdf(ray, hit_record, wo));
+  }
+  // scatter() picks a uniform point on the sphere of radius fuzz_ around the
+  // mirror direction. Convert its area density 1 / (4 * PI * fuzz_^2) to solid
+  // angle at each point where wo pierces that sphere.
+  virtual double pdf(Ray const& ray, HitRecord const& hit_record,
+                     Direction const& wo) const override {
+    if (isSpecular()) return 0.0;
+    Direction reflected =
+        reflect(ray.direction().normalize(), hit_record.normal_);
+    double b = dot(wo, reflected);
+    double discriminant = b * b - (1.0 - fuzz_ * fuzz_);
+    if (discriminant <= 0) return 0.0;
+    double result = 0.0;
+    for (double root : {b - sqrt(discriminant), b + sqrt(discriminant)}) {
+      if (root <= 0) continue;
+      Direction normal = (root * wo - reflected) / fuzz_;
+      double cos_alpha = std::abs(dot(wo, normal));
+      if (cos_alpha < 1e-6) return 0.0;
+      result += root * root / (4.0 * PI * fuzz_ * fuzz_ * cos_alpha);
+    }
+    return result;
+  }
+  virtual bool isSpecular() const override { return fuzz_ == 0.0; }
+  virtual int split(int max_split) const override {
+    return std::clamp(static_cast<int>(std::ceil(max_split * fuzz_)), 1,
+                      std::max(1, max_split));
+  }
+  virtual double roughness() const override { return fuzz_; }
+  virtual Color albedo(HitRecord const&) const override { return albedo_; }
 
  private:
   Color albedo_;
@@ -99,10 +196,24 @@ class DiffusingLight : public Material {
     return false;
   }
   virtual Color emit(HitRecord const& hit_record) const override {
-    return factor_ * texture_->getColor(hit_record.normal_);
+    return factor_ * color(hit_record);
+  }
+  virtual bool isEmissive() const override { return true; }
+  virtual Color albedo(HitRecord const& hit_record) const override {
+    return color(hit_record);
+  }
+  virtual float power() const override {
+    Color average = texture_->average();
+    return factor_ * (average.x() + average.y() + average.z()) / 3.0f;
   }
 
  private:
+  // The texture at the hit, at the hit's level of detail.
+  Color color(HitRecord const& hit_record) const {
+    return texture_->getColorAtLevel(hit_record.normal_,
+                                     hit_record.texture_level_);
+  }
+
   std::shared_ptr<Texture> texture_;
   float factor_;
 };
@@ -0,0 +1,76 @@
+#ifndef MEDIUM_H
+#define MEDIUM_H
+#include <algorithm>
+#include <cmath>
+
+#include "utility.h"
+#include "vec3.h"
+
+// A homogeneous participating medium. Light is extinguished at rate sigma_t_
+// per unit length, of which the fraction albedo_ is scattered rather than
+// absorbed, into directions distributed by the Henyey-Greenstein phase
+// function with asymmetry g_: forward for g_ > 0, backward for g_ < 0.
+// A medium with sigma_t_ == 0 is clear air.
+struct HomogeneousMedium {
+  double sigma_t_ = 0.0;
+  float albedo_ = 1.0f;
+  double g_ = 0.0;
+
+  bool enabled() const { return sigma_t_ > 0.0; }
+
+  // Fraction of light that crosses distance unextinguished.
+  double transmittance(double distance) const {
+    return enabled() ? std::exp(-sigma_t_ * distance) : 1.0;
+  }
+
+  // Density of a free flight ending at distance.
+  double density(double distance) const {
+    return sigma_t_ * std::exp(-sigma_t_ * distance);
+  }
+
+  // Distance to the next interaction, INF in clear air.
+  double sampleDistance() const {
+    if (!enabled()) return INF;
+    return -std::log(1.0 - rand_double()) / sigma_t_;
+  }
+
+  // A free flight conditioned to end before max_distance, which has density
+  // density(d) / (1 - transmittance(max_distance)).
+  double sampleDistance(double max_distance) const {
+    double absorbed = 1.0 - transmittance(max_distance);
+    return -std::log(1.0 - rand_double() * absorbed) / sigma_t_;
+  }
+
+  // Density of scattering light traveling along the unit direction d into
+  // the unit direction wo, per solid angle.
+  double phase(Direction const& d, Direction const& wo) const {
+    double denominator = 1.0 + g_ * g_ - 2.0 * g_ * dot(d, wo);
+    return (1.0 - g_ * g_) / (4.0 * PI * denominator * std::sqrt(denominator));
+  }
+
+  // The largest value phase() takes.
+  double maxPhase() const {
+    double g = std::abs(g_);
+    return (1.0 + g) / (4.0 * PI * (1.0 - g) * (1.0 - g));
+  }
+
+  // Sample a direction to scatter light traveling along the unit direction d
+  // into, with density phase(d, wo).
+  Direction samplePhase(Direction const& d) const {
+    double cos_theta;
+    if (std::abs(g_) < 1e-3) {
+      cos_theta = 1.0 - 2.0 * rand_double();
+    } else {
+      double s = (1.0 - g_ * g_) / (1.0 - g_ + 2.0 * g_ * rand_double());
+      cos_theta = (1.0 + g_ * g_ - s * s) / (2.0 * g_);
+    }
+    double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+    double phi = 2.0 * PI * rand_double();
+    Direction u, v;
+    orthonormalBasis(d, u, v);
+    return (sin_theta * std::cos(phi)) * u + (sin_theta * std::sin(phi)) * v +
+           cos_theta * d;
+  }
+};
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+// How direct lighting picks one of the emissive spheres.
+enum class LightSampler {
+  // Traverse a light tree by estimated contribution, O(log n).
+  TREE,
+  // Alias table proportional to emitted power alone, O(1).
+  POWER,
+  // Power times subtended solid angle over all lights, O(n).
+  EXHAUSTIVE,
+};
+
+// How the image is rendered.
+enum class Integrator {
+  // Unidirectional path tracing with World::traceRay.
+  PATH,
+  // Direct lighting only, by reservoir resampling, see restir.h.
+  RESTIR,
+  // Path tracing guided by a learned radiance distribution, see
+  // path_guiding.h.
+  GUIDED,
+  // Bidirectional path tracing, see bdpt.h.
+  BDPT,
+  // Virtual point lights shaded through lightcuts, see lightcuts.h.
+  LIGHTCUTS,
+  // Gradient-domain path tracing, see gradient_domain.h.
+  GRADIENT,
+  // Primary sample space Metropolis light transport, see pssmlt.h.
+  MLT,
+  // Previews, see preview.h: the color of the first surface hit, ambient
+  // occlusion, and direct lighting alone.
+  ALBEDO,
+  AO,
+  DIRECT,
+};
+
+// The --integrator values, in the order of Integrator.
+static char const* const INTEGRATOR_NAMES[] = {
+    "path", "restir", "guided", "bdpt", "lightcuts",
+    "gradient", "mlt", "albedo", "ao", "direct"};
+
+// Render settings, overridable from the command line with --name=value flags.
+struct Options {
+  Integrator integrator = Integrator::PATH;
+  // Enclose each emitter in a glass sphere a quarter larger, so that light
+  // reaches the scene only through glass and light sampling is blocked.
+  bool glass_shells = false;
+  // Path tracing: samples per pixel added by each pass over the image, and
+  // the least time in seconds between snapshots of the image so far, which
+  // replace world.ppm.
+  int pass_spp = 16;
+  double snapshot_interval = 10.0;
+  // When positive, the seconds from start-up by which the progressive path
+  // tracer should have written world.ppm: after a pass of one sample to
+  // measure its speed, it takes passes only as far as they still fit, so
+  // every pixel has as many samples, at most SAMPLE_RATE ^ 2.
+  double time_budget = 0.0;
+  // When positive, the least time in seconds between checkpoints of the
+  // progressive path tracer's film to the file checkpoint, written in the
+  // background. resume continues from that file, rendered with the same
+  // options, instead of starting over.
+  double checkpoint_interval = 0.0;
+  std::string checkpoint = "world.checkpoint";
+  bool resume = false;
+  // Comma separated AOVs for path tracing, adaptive or not, to write, see
+  // aov.h, or "all".
+  std::string aovs;
+  // Filter path tracing's image, adaptive or not, with an edge-avoiding
+  // A-trous wavelet denoiser of denoise_iterations passes, guided by the
+  // first-hit albedo, normal and distance AOVs of its paths and by the
+  // per-pixel variance; the sigmas scale how much the luminance, in standard
+  // deviations, the albedo and the distance, relative per pixel, may differ
+  // before a neighbor stops counting. See denoiser.h.
+  bool denoise = false;
+  int denoise_iterations = 5;
+  double denoise_sigma_luminance = 4.0;
+  double denoise_sigma_albedo = 0.25;
+  double denoise_sigma_depth = 0.05;
+  // Path tracing with adaptive sampling when positive: pixels take batches
+  // of adaptive_batch samples until the 95% confidence interval of their
+  // mean is within target_error of it, or the SAMPLE_RATE ^ 2 per pixel
+  // budget is spent; see adaptive.h.
+  double target_error = 0.0;
+  int adaptive_batch = 16;
+  // Paths that share each camera ray, divided between the fog along it and
+  // the first non-specular surface; see Material::split. main.cc traces
+  // correspondingly fewer camera rays.
+  int primary_split = 1;
+  // Sample the emissive spheres explicitly at diffuse and fog vertices.
+  bool next_event_estimation = true;
+  LightSampler light_sampler = LightSampler::TREE;
+  // Combine light sampling with BSDF sampling by multiple importance
+  // sampling, instead of relying on light sampling alone.
+  bool mis = true;
+  // The fog, a homogeneous medium: extinction per unit length, 0 for clear
+  // air; the fraction of it that scatters; and the Henyey-Greenstein
+  // asymmetry of the scattering, forward if positive.
+  double fog_density = 0.06;
+  double fog_albedo = 0.9;
+  double fog_anisotropy = 0.0;
+  // Ground fog in a voxel grid instead: fog_volume_density at the ground,
+  // thinning out over fog_volume_height and broken up by noise, in cubic
+  // voxels fog_volume_resolution to a side of the scene. fog_albedo and
+  // fog_anisotropy still apply.
+  bool fog_volume = false;
+  double fog_volume_density = 0.3;
+  double fog_volume_height = 0.4;
+  int fog_volume_resolution = 128;
+  // March through the grid at this fixed step instead of delta and ratio
+  // tracking, a biased baseline to compare against. 0 tracks.
+  double fog_volume_step = 0.0;
+  // Equirectangular image, such as a Radiance .hdr, lighting the scene from
+  // all around instead of the dim sky gradient, with its radiance scaled by
+  // envmap_scale. Empty for the gradient.
+  std::string envmap;
+  double envmap_scale = 1.0;
+  // Shading level of detail for path tracing: from bounce lod_mip_depth on,
+  // textures are read at mip level lod_mip_level, and from bounce
+  // lod_average_depth on, or once the roughness accumulated along the path
+  // reaches lod_roughness, as their average color. Diffuse and fog vertices
+  // add 1 to the roughness, fuzzy metal its fuzz.
+  bool shading_lod = false;
+  int lod_mip_depth = 2;
+  int lod_mip_level = 4;
+  int lod_average_depth = 3;
+  double lod_roughness = 2.0;
+  // Also sample the fog along camera rays toward the emitters,
+  // equiangularly, when light sampling is on. This costs a pass over the
+  // emitters per camera ray.
+  bool equiangular = false;
+
+  // ReSTIR: progressive passes, each one sample per pixel.
+  int restir_passes = 4;
+  // Light samples streamed through each pixel's reservoir per pass.
+  int restir_candidates = 32;
+  // Neighboring pixels merged per pass, and their maximum pixel offset.
+  int restir_spatial = 5;
+  int restir_radius = 16;
+  // Merge each pixel's reservoir from the previous pass. This makes every
+  // pass less noisy but correlates the passes, so it suits displaying passes
+  // as they finish more than averaging them.
+  bool restir_temporal = false;
+
+  // Path guiding: learning passes, with 1, 2, 4, ... spp, before the rest of
+  // the SAMPLE_RATE ^ 2 budget is rendered with the learned distribution.
+  int guiding_training_passes = 5;
+  // Probability of sampling the learned distribution instead of the BSDF.
+  double guiding_fraction = 0.5;
+  // Records per spatial cell before it splits, scaled by sqrt(2^pass).
+  int guiding_spatial_threshold = 4000;
+  // Share of a cell's energy above which a directional quadrant subdivides.
+  double guiding_directional_threshold = 0.01;
+
+  // BDPT: camera and light subpath pairs per pixel, and the longest path in
+  // bounces.
+  int bdpt_spp = 16;
+  int bdpt_max_depth = 12;
+
+  // Photons shot for the caustic photon map before rendering, 0 for none,
+  // and the radius they are gathered from.
+  int caustic_photons = 0;
+  double caustic_radius = 0.05;
+
+  // End paths in a radiance cache after their first diffuse bounce. Higher
+  // quality means smaller cache cells that need more records before use.
+  bool radiance_cache = false;
+  double radiance_cache_quality = 1.0;
+
+  // Lightcuts: light subpaths that leave VPLs, and their most bounces.
+  int vpl_paths = 10000;
+  int vpl_max_depth = 8;
+  // Bound on the geometric term cos / d^2 of a VPL, which trades the bright
+  // splotches near VPLs for darkened corners. 0 disables clamping.
+  double vpl_clamp = 0.0;
+  int vpl_spp = 4;
+  // A cut is refined until every cluster's error bound is below this
+  // fraction of the total, or it has lightcut_max clusters.
+  double lightcut_error = 0.02;
+  int lightcut_max = 1000;
+
+  // Gradient-domain: base paths per pixel, each with 4 offset paths, and the
+  // weight of the base paths against the gradients in the reconstruction.
+  int gradient_spp = 16;
+  double gradient_alpha = 0.2;
+  int poisson_iterations = 100;
+
+  // PSSMLT: mutations per pixel, independent paths estimating the
+  // normalization and seeding the chains, the number of chains, the
+  // probability of a large step, the standard deviation of small steps, and
+  // the power of the luminance the chains sample in proportion to.
+  int mlt_mutations = 16;
+  int mlt_bootstrap = 100000;
+  int mlt_chains = 256;
+  double mlt_large_step = 0.3;
+  double mlt_sigma = 0.01;
+  double mlt_exponent = 0.5;
+
+  // Previews: samples per pixel, and for ambient occlusion the rays per
+  // sample and how far they look for occluders. At 2 or 4, previews render
+  // one color per preview_upsample x preview_upsample block of pixels and
+  // upsample it, see upsampler.h; 1 renders every pixel.
+  int preview_spp = 1;
+  int preview_upsample = 1;
+  int ao_rays = 4;
+  double ao_distance = 1.0;
+
+  static Options& get() {
+    static Options options;
+    return options;
+  }
+
+  // A bare --name is shorthand for --name=1. Unknown flags and malformed
+  // values are reported and ignored so that a typo doesn't abort a long
+  // render.
+  void parse(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      size_t eq = arg.find('=');
+      std::string name = arg.substr(0, eq);
+      std::string value = eq == std::string::npos ? "1" : arg.substr(eq + 1);
+      if (!set(name, value)) {
+        std::cerr << "Unknown flag or bad value " << arg << std::endl;
+      }
+    }
+  }
+
+ private:
+  bool set(std::string const& name, std::string const& value) {
+    if (name == "--nee") return assign(value, next_event_estimation);
+    if (name == "--light_sampler") return assign(value, light_sampler);
+    if (name == "--mis") return assign(value, mis);
+    if (name == "--fog_density") return assign(value, fog_density);
+    if (name == "--fog_albedo") return assign(value, fog_albedo);
+    if (name == "--fog_anisotropy") return assign(value, fog_anisotropy);
+    if (name == "--envmap") return assign(value, envmap);
+    if (name == "--envmap_scale") return assign(value, envmap_scale);
+    if (name == "--fog_volume") return assign(value, fog_volume);
+    if (name == "--fog_volume_density") {
+      return assign(value, fog_volume_density);
+    }
+    if (name == "--fog_volume_height") {
+      return assign(value, fog_volume_height);
+    }
+    if (name == "--fog_volume_resolution") {
+      return assign(value, fog_volume_resolution);
+    }
+    if (name == "--fog_volume_step") return assign(value, fog_volume_step);
+    if (name == "--shading_lod") return assign(value, shading_lod);
+    if (name == "--lod_mip_depth") return assign(value, lod_mip_depth);
+    if (name == "--lod_mip_level") return assign(value, lod_mip_level);
+    if (name == "--lod_average_depth") {
+      return assign(value, lod_average_depth);
+    }
+    if (name == "--lod_roughness") return assign(value, lod_roughness);
+    if (name == "--equiangular") return assign(value, equiangular);
+    if (name == "--integrator") return assign(value, integrator);
+    if (name == "--pass_spp") return assign(value, pass_spp);
+    if (name == "--snapshot_interval") {
+      return assign(value, snapshot_interval);
+    }
+    if (name == "--time_budget") return assign(value, time_budget);
+    if (name == "--checkpoint_interval") {
+      return assign(value, checkpoint_interval);
+    }
+    if (name == "--checkpoint") return assign(value, checkpoint);
+    if (name == "--resume") return assign(value, resume);
+    if (name == "--aovs") return assign(value, aovs);
+    if (name == "--denoise") return assign(value, denoise);
+    if (name == "--denoise_iterations") {
+      return assign(value, denoise_iterations);
+    }
+    if (name == "--denoise_sigma_luminance") {
+      return assign(value, denoise_sigma_luminance);
+    }
+    if (name == "--denoise_sigma_albedo") {
+      return assign(value, denoise_sigma_albedo);
+    }
+    if (name == "--denoise_sigma_depth") {
+      return assign(value, denoise_sigma_depth);
+    }
+    if (name == "--target_error") return assign(value, target_error);
+    if (name == "--adaptive_batch") return assign(value, adaptive_batch);
+    if (name == "--glass_shells") return assign(value, glass_shells);
+    if (name == "--primary_split") return assign(value, primary_split);
+    if (name == "--restir_passes") return assign(value, restir_passes);
+    if (name == "--restir_candidates") return assign(value, restir_candidates);
+    if (name == "--restir_spatial") return assign(value, restir_spatial);
+    if (name == "--restir_radius") return assign(value, restir_radius);
+    if (name == "--restir_temporal") return assign(value, restir_temporal);
+    if (name == "--guiding_training_passes") {
+      return assign(value, guiding_training_passes);
+    }
+    if (name == "--guiding_fraction") return assign(value, guiding_fraction);
+    if (name == "--guiding_spatial_threshold") {
+      return assign(value, guiding_spatial_threshold);
+    }
+    if (name == "--guiding_directional_threshold") {
+      return assign(value, guiding_directional_threshold);
+    }
+    if (name == "--bdpt_spp") return assign(value, bdpt_spp);
+    if (name == "--bdpt_max_depth") return assign(value, bdpt_max_depth);
+    if (name == "--caustic_photons") return assign(value, caustic_photons);
+    if (name == "--caustic_radius") return assign(value, caustic_radius);
+    if (name == "--radiance_cache") return assign(value, radiance_cache);
+    if (name == "--radiance_cache_quality") {
+      return assign(value, radiance_cache_quality);
+    }
+    if (name == "--vpl_paths") return assign(value, vpl_paths);
+    if (name == "--vpl_max_depth") return assign(value, vpl_max_depth);
+    if (name == "--vpl_clamp") return assign(value, vpl_clamp);
+    if (name == "--vpl_spp") return assign(value, vpl_spp);
+    if (name == "--lightcut_error") return assign(value, lightcut_error);
+    if (name == "--lightcut_max") return assign(value, lightcut_max);
+    if (name == "--gradient_spp") return assign(value, gradient_spp);
+    if (name == "--gradient_alpha") return assign(value, gradient_alpha);
+    if (name == "--poisson_iterations") {
+      return assign(value, poisson_iterations);
+    }
+    if (name == "--mlt_mutations") return assign(value, mlt_mutations);
+    if (name == "--mlt_bootstrap") return assign(value, mlt_bootstrap);
+    if (name == "--mlt_chains") return assign(value, mlt_chains);
+    if (name == "--mlt_large_step") return assign(value, mlt_large_step);
+    if (name == "--mlt_sigma") return assign(value, mlt_sigma);
+    if (name == "--mlt_exponent") return assign(value, mlt_exponent);
+    if (name == "--preview_spp") return assign(value, preview_spp);
+    if (name == "--preview_upsample") {
+      int factor = 0;
+      bool valid = assign(value, factor) &&
+                   (factor == 1 || factor == 2 || factor == 4);
+      if (!valid) return false;
+      preview_upsample = factor;
+      return true;
+    }
+    if (name == "--ao_rays") return assign(value, ao_rays);
+    if (name == "--ao_distance") return assign(value, ao_distance);
+    return false;
+  }
+
+  static bool assign(std::string const& value, bool& field) {
+    field = value != "0" && value != "false";
+    return true;
+  }
+  // Malformed numbers leave the field as it is and count as unknown.
+  static bool assign(std::string const& value, int& field) {
+    try {
+      field = std::stoi(value);
+    } catch (std::logic_error const&) {
+      return false;
+    }
+    return true;
+  }
+  static bool assign(std::string const& value, double& field) {
+    try {
+      field = std::stod(value);
+    } catch (std::logic_error const&) {
+      return false;
+    }
+    return true;
+  }
+  static bool assign(std::string const& value, std::string& field) {
+    field = value;
+    return true;
+  }
+  static bool assign(std::string const& value, LightSampler& field) {
+    if (value == "tree") {
+      field = LightSampler::TREE;
+    } else if (value == "power") {
+      field = LightSampler::POWER;
+    } else if (value == "exhaustive") {
+      field = LightSampler::EXHAUSTIVE;
+    } else {
+      return false;
+    }
+    return true;
+  }
+  static bool assign(std::string const& value, Integrator& field) {
+    for (int i = 0; i <= static_cast<int>(Integrator::DIRECT); i++) {
+      if (value == INTEGRATOR_NAMES[i]) {
+        field = static_cast<Integrator>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Divide rows [0, rows) into one contiguous band per hardware thread and call
+// func(row) for each row.
+// TODO(chaoqin-li1123): Use GPU for parallelism.
+template <typename Func>
+void parallelRows(int rows, Func const& func) {
+  int thread_cnt = std::max(1u, std::thread::hardware_concurrency());
+  int interval = std::max(1, (rows + thread_cnt - 1) / thread_cnt);
+  std::vector<std::thread> threads;
+  for (int h0 = 0; h0 < rows; h0 += interval) {
+    threads.emplace_back([&func, h0, h1 = std::min(rows, h0 + interval)]() {
+      for (int h = h0; h < h1; h++) func(h);
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PATH_GUIDING_H
+#define PATH_GUIDING_H
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "camera.h"
+#include "parallel.h"
+#include "sd_tree.h"
+#include "world.h"
+
+// Path tracing that learns where light comes from while it renders. Passes
+// double in sample count, and each one guides scattering at non-specular
+// surfaces with the SDTree learned by the passes before it, while recording
+// into a refined tree for the next. The last pass only renders. All passes
+// are unbiased, so the image is their average weighted by sample count.
+struct PathGuiding {
+  static void render(Camera& camera, Image& image) {
+    Options const& options = Options::get();
+    SDTree tree(World::bounds());
+    std::vector<Color> sum(IMAGE_W * IMAGE_H);
+    int budget = SAMPLE_RATE * SAMPLE_RATE;
+    int spent = 0;
+    for (int pass = 0; spent < budget; pass++) {
+      bool learning = pass < options.guiding_training_passes;
+      int spp = learning ? std::min(1 << pass, budget - spent) : budget - spent;
+      World::setGuide(&tree, learning);
+      parallelRows(IMAGE_H, [&](int h) {
+        for (int w = 0; w < IMAGE_W; w++) {
+          for (int s = 0; s < spp; s++) {
+            double dx = std::clamp((w + rand_double(-1, 1)) / (IMAGE_W - 1),
+                                   0.0, 1.0);
+            double dy = std::clamp((h + rand_double(-1, 1)) / (IMAGE_H - 1),
+                                   0.0, 1.0);
+            sum[h * IMAGE_W + w] += World::traceRay(camera.emitRay(dx, dy), 0);
+          }
+        }
+      });
+      spent += spp;
+      if (learning) {
+        // Müller et al. split a leaf after c * sqrt(2^k) records in pass k.
+        tree.refine(static_cast<long long>(options.guiding_spatial_threshold *
+                                           std::sqrt(1 << pass)),
+                    options.guiding_directional_threshold);
+      }
+      std::cerr << "guiding pass " << pass << ": " << spp << " spp"
+                << std::endl;
+    }
+    World::setGuide(nullptr, false);
+
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        image[h][w] = sum[h * IMAGE_W + w] / static_cast<float>(spent);
+      }
+    }
+  }
+};
+
+#endif
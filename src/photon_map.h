@@ -0,0 +1,114 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "aabb.h"
+
+class Hittable;
+
+struct Photon {
+  Point p_;
+  // The primitive the photon landed on, and whether it arrived from outside.
+  Hittable const* hittable_;
+  bool front_face_;
+  // Unit direction back toward where the photon came from.
+  Direction wi_;
+  Color power_;
+};
+
+// Photons in a balanced kd-tree, stored implicitly: the median photon of each
+// range is its node, split along the widest axis of the range, with the two
+// halves of the range as its subtrees.
+class PhotonMap {
+ public:
+  PhotonMap() = default;
+  explicit PhotonMap(std::vector<Photon> photons)
+      : photons_(std::move(photons)), axes_(photons_.size()) {
+    // The top levels split into independent subtrees, one thread each.
+    int levels = 0;
+    while ((1u << levels) < std::thread::hardware_concurrency()) levels++;
+    build(0, photons_.size(), levels);
+  }
+  PhotonMap(PhotonMap&& other)
+      : photons_(std::move(other.photons_)), axes_(std::move(other.axes_)) {}
+
+  size_t size() const { return photons_.size(); }
+
+  // Call func(photon) for every photon within radius of p.
+  template <typename Func>
+  void gather(Point const& p, double radius, Func const& func) const {
+    auto start = std::chrono::steady_clock::now();
+    gather(0, photons_.size(), p, radius * radius, func);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    queries_.fetch_add(1, std::memory_order_relaxed);
+    query_ns_.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+  }
+
+  void printStats() const {
+    long long queries = queries_.load();
+    std::cerr << "photon map: " << queries << " queries, "
+              << (queries ? query_ns_.load() / 1000.0 / queries : 0.0)
+              << " us each" << std::endl;
+  }
+
+ private:
+  void build(size_t begin, size_t end, int parallel_levels) {
+    if (end - begin <= 1) return;
+    Aabb box;
+    for (size_t i = begin; i < end; i++) box.grow(photons_[i].p_);
+    int dim = box.maxExtent();
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(photons_.begin() + begin, photons_.begin() + mid,
+                     photons_.begin() + end,
+                     [dim](Photon const& a, Photon const& b) {
+                       return axis(a.p_, dim) < axis(b.p_, dim);
+                     });
+    axes_[mid] = dim;
+    if (parallel_levels > 0) {
+      std::thread left([=] { build(begin, mid, parallel_levels - 1); });
+      build(mid + 1, end, parallel_levels - 1);
+      left.join();
+    } else {
+      build(begin, mid, 0);
+      build(mid + 1, end, 0);
+    }
+  }
+
+  template <typename Func>
+  void gather(size_t begin, size_t end, Point const& p, double radius_squared,
+              Func const& func) const {
+    while (begin < end) {
+      size_t mid = begin + (end - begin) / 2;
+      Photon const& photon = photons_[mid];
+      if ((photon.p_ - p).lenSquared() <= radius_squared) func(photon);
+      double offset = axis(p, axes_[mid]) - axis(photon.p_, axes_[mid]);
+      // Recurse into the far side only if the sphere crosses the plane.
+      if (offset < 0) {
+        if (offset * offset <= radius_squared) {
+          gather(mid + 1, end, p, radius_squared, func);
+        }
+        end = mid;
+      } else {
+        if (offset * offset <= radius_squared) {
+          gather(begin, mid, p, radius_squared, func);
+        }
+        begin = mid + 1;
+      }
+    }
+  }
+
+  std::vector<Photon> photons_;
+  std::vector<unsigned char> axes_;
+  mutable std::atomic<long long> queries_{0};
+  mutable std::atomic<long long> query_ns_{0};
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef POISSON_H
+#define POISSON_H
+#include <cmath>
+#include <vector>
+
+// Screened Poisson reconstruction of one image channel: the image x that
+// minimizes alpha^2 |x - primal|^2 + |Dx - g|^2, where D takes the forward
+// differences between horizontal and vertical neighbors. gx[h * width + w]
+// estimates x(h, w + 1) - x(h, w) and gy[h * width + w] estimates
+// x(h + 1, w) - x(h, w); the last column of gx and row of gy are unused.
+// Solved by conjugate gradients on alpha^2 x + D^T D x = alpha^2 primal +
+// D^T g, starting from primal.
+class ScreenedPoisson {
+ public:
+  ScreenedPoisson(int width, int height, double alpha)
+      : width_(width), height_(height), alpha2_(alpha * alpha) {}
+
+  std::vector<double> solve(std::vector<double> const& primal,
+                            std::vector<double> const& gx,
+                            std::vector<double> const& gy,
+                            int iterations) const {
+    int n = width_ * height_;
+    std::vector<double> b(n);
+    for (int i = 0; i < n; i++) b[i] = alpha2_ * primal[i];
+    for (int h = 0; h < height_; h++) {
+      for (int w = 0; w < width_; w++) {
+        int i = h * width_ + w;
+        if (w + 1 < width_) {
+          b[i] -= gx[i];
+          b[i + 1] += gx[i];
+        }
+        if (h + 1 < height_) {
+          b[i] -= gy[i];
+          b[i + width_] += gy[i];
+        }
+      }
+    }
+
+    std::vector<double> x = primal, r(n), p(n), ap(n);
+    apply(x, ap);
+    for (int i = 0; i < n; i++) r[i] = b[i] - ap[i];
+    p = r;
+    double rr = dot(r, r);
+    for (int k = 0; k < iterations && rr > 1e-20; k++) {
+      apply(p, ap);
+      double step = rr / dot(p, ap);
+      for (int i = 0; i < n; i++) {
+        x[i] += step * p[i];
+        r[i] -= step * ap[i];
+      }
+      double rr_next = dot(r, r);
+      for (int i = 0; i < n; i++) p[i] = r[i] + rr_next / rr * p[i];
+      rr = rr_next;
+    }
+    return x;
+  }
+
+ private:
+  // out = alpha^2 x + D^T D x.
+  void apply(std::vector<double> const& x, std::vector<double>& out) const {
+    for (int h = 0; h < height_; h++) {
+      for (int w = 0; w < width_; w++) {
+        int i = h * width_ + w;
+        double result = alpha2_ * x[i];
+        if (w > 0) result += x[i] - x[i - 1];
+        if (w + 1 < width_) result += x[i] - x[i + 1];
+        if (h > 0) result += x[i] - x[i - width_];
+        if (h + 1 < height_) result += x[i] - x[i + width_];
+        out[i] = result;
+      }
+    }
+  }
+
+  static double dot(std::vector<double> const& a,
+                    std::vector<double> const& b) {
+    double sum = 0.0;
+    for (size_t i = 0; i < a.size(); i++) sum += a[i] * b[i];
+    return sum;
+  }
+
+  int width_, height_;
+  double alpha2_;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "camera.h"
+#include "parallel.h"
+#include "world.h"
+
+// Fast previews for placing the camera and the spheres, a few samples per
+// pixel and at most one shading point per sample:
+//  - ALBEDO: the color of the first surface a camera ray hits.
+//  - AO: ambient occlusion at the first surface, the fraction of cosine
+//    distributed rays that travel ao_distance without hitting a sphere.
+//    These are any-hit rays, cheaper than finding the closest hit.
+//  - DIRECT: light from the emissive spheres at the first non-specular
+//    vertex, through specular chains and the fog, without further bounces.
+// ALBEDO and AO ignore the fog.
+struct Preview {
+  static void render(Camera& camera, Image& image, Integrator mode) {
+    auto start = std::chrono::steady_clock::now();
+    int spp = Options::get().preview_spp;
+    parallelRows(IMAGE_H, [&](int h) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        Color sum(0, 0, 0);
+        for (int s = 0; s < spp; s++) {
+          double dx = std::clamp((w + rand_double(-1, 1)) / (IMAGE_W - 1),
+                                 0.0, 1.0);
+          double dy = std::clamp((h + rand_double(-1, 1)) / (IMAGE_H - 1),
+                                 0.0, 1.0);
+          sum += shade(camera.emitRay(dx, dy), mode);
+        }
+        image[h][w] = sum / static_cast<float>(spp);
+      }
+    });
+    std::cerr << "preview rendered in "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << "s" << std::endl;
+  }
+
+  // One color per factor x factor block of pixels, the mean of preview_spp
+  // samples uniform over the block, into blocks, row by row, for a
+  // JointBilateralUpsampler of the same factor.
+  static void renderBlocks(Camera& camera, int factor, Integrator mode,
+                           std::vector<Color>& blocks) {
+    int width = (IMAGE_W + factor - 1) / factor;
+    int height = (IMAGE_H + factor - 1) / factor;
+    int spp = Options::get().preview_spp;
+    blocks.assign(width * height, Color(0, 0, 0));
+    parallelRows(height, [&](int y) {
+      for (int x = 0; x < width; x++) {
+        Color sum(0, 0, 0);
+        for (int s = 0; s < spp; s++) {
+          double dx = offset(x, factor, IMAGE_W) / (IMAGE_W - 1);
+          double dy = offset(y, factor, IMAGE_H) / (IMAGE_H - 1);
+          sum += shade(camera.emitRay(dx, dy), mode);
+        }
+        blocks[y * width + x] = sum / static_cast<float>(spp);
+      }
+    });
+  }
+
+ private:
+  static Color shade(Ray const& ray, Integrator mode) {
+    return mode == Integrator::ALBEDO ? albedo(ray)
+           : mode == Integrator::AO   ? ambientOcclusion(ray)
+                                      : direct(ray);
+  }
+
+  // A uniform position within block i's pixels, clipped to the image.
+  static double offset(int i, int factor, int size) {
+    double begin = i * factor - 0.5;
+    double end = std::min(size, (i + 1) * factor) - 0.5;
+    return std::clamp(rand_double(begin, end), 0.0, size - 1.0);
+  }
+
+  static Color albedo(Ray const& ray) {
+    HitRecord hit_record;
+    if (!World::intersect(ray, hit_record)) return Background::color(ray);
+    return hit_record.material_->albedo(hit_record);
+  }
+
+  static Color ambientOcclusion(Ray const& ray) {
+    HitRecord hit_record;
+    if (!World::intersect(ray, hit_record) ||
+        hit_record.material_->isEmissive()) {
+      return Color(1, 1, 1);
+    }
+    Options const& options = Options::get();
+    int open = 0;
+    for (int i = 0; i < options.ao_rays; i++) {
+      Direction d = hit_record.normal_ + Direction::rand_unit_vec();
+      if (d.nearZero()) d = hit_record.normal_;
+      Point y = hit_record.p_ + d.normalize() * options.ao_distance;
+      if (!World::occluded(hit_record.p_, y)) open++;
+    }
+    float value = static_cast<float>(open) / std::max(1, options.ao_rays);
+    return Color(value, value, value);
+  }
+
+  static Color direct(Ray const& ray) {
+    ShadingPoint point = World::findShadingPoint(ray);
+    if (!point.valid_ || World::emitters().empty()) return point.emitted_;
+    // No BSDF sample follows, so light sampling takes all the weight.
+    Color light = World::directLight(
+        point.p(), point.normal(), [&](Direction const& wi, double& pdf) {
+          Color f = point.eval(wi, pdf);
+          pdf = 0.0;
+          return f;
+        });
+    return point.emitted_ + point.throughput_ * light;
+  }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aov.h"
+#include "camera.h"
+#include "film.h"
+#include "parallel.h"
+#include "world.h"
+
+// Path tracing of rate ^ 2 stratified samples per pixel, taken in passes
+// over the whole image that each add some of them to every pixel and
+// accumulate them in a Film, so that the image so far can be written out
+// between passes. The strata are taken in a fixed shuffle of the rate x
+// rate grid, so any number of them is spread over the pixel. Each row of
+// each pass draws its random numbers from its own stream, seeded by the
+// samples taken before the pass, so the film and that count are the whole
+// state of a render: a checkpoint of the two, resumed with the same passes,
+// renders the same image as an uninterrupted run. The AOVs in a mask are
+// recorded by the same paths into an AovFramebuffer, checkpointed with the
+// film.
+class ProgressiveRenderer {
+ public:
+  ProgressiveRenderer(Camera const& camera, int rate, unsigned aovs = 0)
+      : camera_(camera),
+        rate_(rate),
+        strata_(rate * rate),
+        film_(IMAGE_W, IMAGE_H) {
+    std::iota(strata_.begin(), strata_.end(), 0);
+    std::shuffle(strata_.begin(), strata_.end(), std::mt19937(0));
+    if (aovs) aovs_ = std::make_unique<AovFramebuffer>(IMAGE_W, IMAGE_H, aovs);
+  }
+
+  ~ProgressiveRenderer() { waitForCheckpoint(); }
+
+  // Samples per pixel taken so far, and in all.
+  int samples() const { return samples_; }
+  int total() const { return rate_ * rate_; }
+  Film const& film() const { return film_; }
+  // Null without AOVs.
+  AovFramebuffer const* aovs() const { return aovs_.get(); }
+
+  // Add the next count samples to every pixel, fewer if not that many are
+  // left.
+  void renderPass(int count) {
+    int first = samples_;
+    int last = std::min(total(), first + count);
+    double const SAMPLE_INTERVAL = 2.0 / rate_;
+    parallelRows(IMAGE_H, [&](int h) {
+      StreamSource source(static_cast<uint64_t>(first) * IMAGE_H + h);
+      random_source = &source;
+      AovSample sample;
+      if (aovs_) World::setAovSample(&sample);
+      for (int w = 0; w < IMAGE_W; w++) {
+        for (int s = first; s < last; s++) {
+          int i = strata_[s] % rate_ - rate_ / 2;
+          int j = strata_[s] / rate_ - rate_ / 2;
+          double dx = (w + i * SAMPLE_INTERVAL) / (IMAGE_W - 1);
+          double dy = (h + j * SAMPLE_INTERVAL) / (IMAGE_H - 1);
+          if (dx < 0.0 || dx > 1.0 || dy < 0.0 || dy > 1.0) continue;
+          Ray ray = camera_.emitRay(dx, dy, camera_.sampleLens());
+          if (!aovs_) {
+            film_.add(h, w, World::traceRay(ray, 0));
+            continue;
+          }
+          sample = AovSample();
+          Color color = World::traceRay(ray, 0);
+          film_.add(h, w, color);
+          aovs_->add(h, w, sample, color);
+        }
+      }
+      random_source = nullptr;
+      World::setAovSample(nullptr);
+    });
+    samples_ = last;
+  }
+
+  // The mean of each pixel's samples so far.
+  void resolve(Image& image) const {
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) image[h][w] = film_.mean(h, w);
+    }
+  }
+
+  // Write the image so far to filename, replacing it atomically.
+  void snapshot(std::string const& filename) const {
+    auto image = std::make_unique<Image>();
+    resolve(*image);
+    ImagePrinter::printPpm(*image, filename);
+  }
+
+  // Save the film, the AOVs and the samples taken to filename on a
+  // background thread, from a copy taken now, and replace the file once it
+  // is written. Waits for the previous checkpoint first.
+  void checkpoint(std::string const& filename) {
+    waitForCheckpoint();
+    auto aovs = aovs_ ? std::make_unique<AovFramebuffer>(*aovs_) : nullptr;
+    writer_ = std::thread([film = film_, aovs = std::move(aovs), filename,
+                           samples = samples_, header = header()]() {
+      std::string temporary = filename + ".tmp";
+      std::ofstream file(temporary, std::ios::binary);
+      file.write(header.data(), header.size());
+      file.write(reinterpret_cast<char const*>(&samples), sizeof(samples));
+      film.write(file);
+      if (aovs) aovs->write(file);
+      file.close();
+      if (file) {
+        std::rename(temporary.c_str(), filename.c_str());
+      } else {
+        std::cerr << "cannot write " << temporary << std::endl;
+      }
+    });
+  }
+  void waitForCheckpoint() {
+    if (writer_.joinable()) writer_.join();
+  }
+
+  // Continue from a checkpoint of a render of the same size, rate and AOVs.
+  // Returns false, with nothing taken, if there is none.
+  bool resume(std::string const& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+    std::string expected = header(), found(expected.size(), '\0');
+    int samples = 0;
+    file.read(&found[0], found.size());
+    file.read(reinterpret_cast<char*>(&samples), sizeof(samples));
+    if (found != expected || !film_.read(file) ||
+        (aovs_ && !aovs_->read(file)) || samples < 0 || samples > total()) {
+      std::cerr << filename << " is not a checkpoint of this render"
+                << std::endl;
+      film_ = Film(IMAGE_W, IMAGE_H);
+      if (aovs_) {
+        aovs_ = std::make_unique<AovFramebuffer>(IMAGE_W, IMAGE_H,
+                                                 aovs_->aovs());
+      }
+      return false;
+    }
+    samples_ = samples;
+    return true;
+  }
+
+ private:
+  // What a checkpoint must match to be resumed by this renderer.
+  std::string header() const {
+    return "checkpoint 3 " + std::to_string(IMAGE_W) + " " +
+           std::to_string(IMAGE_H) + " " + std::to_string(rate_) + " " +
+           std::to_string(aovs_ ? aovs_->aovs() : 0) + "\n";
+  }
+
+  Camera const& camera_;
+  int rate_;
+  // Indices into the rate x rate grid, in the order passes take them.
+  std::vector<int> strata_;
+  Film film_;
+  std::unique_ptr<AovFramebuffer> aovs_;
+  int samples_ = 0;
+  std::thread writer_;
+};
+
+#endif
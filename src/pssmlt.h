@@ -0,0 +1,231 @@
+#ifndef PSSMLT_H
+#define PSSMLT_H
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "alias_table.h"
+#include "camera.h"
+#include "film.h"
+#include "parallel.h"
+#include "world.h"
+
+// A point in primary sample space: the random numbers a path consumes, in
+// order, drawn lazily and mutated by MetropolisSampler::startIteration.
+// Small steps perturb each number by a normal of standard deviation sigma,
+// wrapped around [0, 1); large steps draw all of them afresh. Numbers the
+// path didn't consume for a while catch up on the small steps they missed
+// when next used, as in pbrt's MLTSampler.
+class MetropolisSampler : public RandomSource {
+ public:
+  MetropolisSampler(uint64_t seed, double sigma, double large_step)
+      : rng_(seed), sigma_(sigma), large_step_probability_(large_step) {}
+
+  // Mutate the current point, or draw a fresh one if first is true.
+  void startIteration(bool first = false) {
+    iteration_++;
+    large_step_ = first || uniform() < large_step_probability_;
+    next_ = 0;
+  }
+  void accept() {
+    if (large_step_) last_large_step_ = iteration_;
+  }
+  // Draw the mutations and acceptance tests from here on from seed, keeping
+  // the current point.
+  void reseed(uint64_t seed) {
+    rng_.seed(seed);
+    normal_.reset();
+  }
+  void reject() {
+    for (Sample& sample : samples_) {
+      if (sample.modified_ == iteration_) sample.restore();
+    }
+    iteration_--;
+  }
+
+  double next() override {
+    if (next_ == samples_.size()) samples_.emplace_back();
+    Sample& sample = samples_[next_++];
+    // Reset numbers last touched before the last accepted large step.
+    if (sample.modified_ < last_large_step_) {
+      sample.value_ = uniform();
+      sample.modified_ = last_large_step_;
+    }
+    sample.backup();
+    if (large_step_) {
+      sample.value_ = uniform();
+    } else {
+      double steps = static_cast<double>(iteration_ - sample.modified_);
+      double perturbed =
+          sample.value_ + normal_(rng_) * sigma_ * std::sqrt(steps);
+      sample.value_ = perturbed - std::floor(perturbed);
+    }
+    sample.modified_ = iteration_;
+    return sample.value_;
+  }
+
+  // Independent of the path's numbers, for acceptance tests.
+  double uniform() { return uniform_(rng_); }
+
+ private:
+  struct Sample {
+    double value_ = 0.0, backup_ = 0.0;
+    long long modified_ = 0, backup_modified_ = 0;
+
+    void backup() {
+      backup_ = value_;
+      backup_modified_ = modified_;
+    }
+    void restore() {
+      value_ = backup_;
+      modified_ = backup_modified_;
+    }
+  };
+
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> uniform_;
+  std::normal_distribution<double> normal_;
+  double sigma_;
+  double large_step_probability_;
+  std::vector<Sample> samples_;
+  size_t next_ = 0;
+  long long iteration_ = 0;
+  long long last_large_step_ = 0;
+  bool large_step_ = true;
+};
+
+// Primary sample space Metropolis light transport (Kelemen et al. 2002).
+// Markov chains wander over the random numbers World::traceRay consumes,
+// the first two of which pick the image position, with the luminance of the
+// path's radiance as their target, so once a chain finds a path through
+// the glass to a light it explores its neighbors instead of starting over.
+// The normalization, the mean luminance over the image, is estimated from
+// independent bootstrap paths, which also seed the chains in proportion to
+// their luminance. Every proposal is splatted, weighted by its acceptance
+// probability, and the chains run independently on all threads.
+struct Pssmlt {
+  static void render(Camera const& camera, Image& image) {
+    Options const& options = Options::get();
+    int bootstrap = std::max(1, options.mlt_bootstrap);
+    std::vector<double> weights(bootstrap);
+    int band = 1024;
+    parallelRows((bootstrap + band - 1) / band, [&](int b) {
+      for (int i = b * band; i < std::min(bootstrap, (b + 1) * band); i++) {
+        MetropolisSampler sampler(i, options.mlt_sigma,
+                                  options.mlt_large_step);
+        sampler.startIteration(true);
+        weights[i] = target(trace(camera, sampler).color_);
+      }
+    });
+    double normalization = 0.0;
+    for (double weight : weights) normalization += weight;
+    normalization /= bootstrap;
+    if (normalization <= 0.0) return;
+    AliasTable seeds(weights);
+
+    int chains = std::max(1, options.mlt_chains);
+    long long mutations =
+        static_cast<long long>(options.mlt_mutations) * IMAGE_W * IMAGE_H;
+    SplatBuffer film(IMAGE_W, IMAGE_H);
+    parallelRows(chains, [&](int chain) {
+      // Replay a bootstrap path picked by luminance, with the sampler it
+      // was drawn from, then go on with numbers of the chain's own, so that
+      // chains starting from the same path don't repeat each other. Chain
+      // seeds lie above the bootstrap seeds, which are ints.
+      std::mt19937_64 rng(chain);
+      size_t seed = seeds.sample(std::uniform_real_distribution<double>()(rng));
+      MetropolisSampler sampler(seed, options.mlt_sigma,
+                                options.mlt_large_step);
+      sampler.startIteration(true);
+      Sample current = trace(camera, sampler);
+      sampler.accept();
+      sampler.reseed((static_cast<uint64_t>(chain) + 1) << 32 | seed);
+      long long first = mutations * chain / chains;
+      long long last = mutations * (chain + 1) / chains;
+      for (long long i = first; i < last; i++) {
+        sampler.startIteration();
+        Sample proposed = trace(camera, sampler);
+        double current_target = target(current.color_);
+        double proposed_target = target(proposed.color_);
+        double accept =
+            current_target > 0.0
+                ? std::min(1.0, proposed_target / current_target)
+                : 1.0;
+        if (accept > 0.0) splat(film, proposed, accept / proposed_target);
+        if (accept < 1.0) {
+          splat(film, current, (1.0 - accept) / current_target);
+        }
+        if (sampler.uniform() < accept) {
+          current = proposed;
+          sampler.accept();
+        } else {
+          sampler.reject();
+        }
+      }
+    });
+    float scale = normalization * (IMAGE_W - 1) * (IMAGE_H - 1) /
+                  (static_cast<double>(options.mlt_mutations) * IMAGE_W *
+                   IMAGE_H);
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) image[h][w] = film.get(h, w) * scale;
+    }
+    std::cerr << "pssmlt: normalization " << normalization << " from "
+              << bootstrap << " bootstrap paths, " << chains << " chains of "
+              << mutations / chains << " mutations" << std::endl;
+  }
+
+ private:
+  // A path through (x_, y_), in pixels from the first pixel's center.
+  struct Sample {
+    double x_, y_;
+    Color color_;
+  };
+
+  // Add weight times sample to the pixels whose footprint contains it. As
+  // in renderPaths, pixels average over a box two pixels wide, clipped to
+  // the image.
+  static void splat(SplatBuffer& film, Sample const& sample, double weight) {
+    int w0 = static_cast<int>(sample.x_), h0 = static_cast<int>(sample.y_);
+    for (int h = h0; h <= std::min(h0 + 1, IMAGE_H - 1); h++) {
+      for (int w = w0; w <= std::min(w0 + 1, IMAGE_W - 1); w++) {
+        if (std::abs(sample.x_ - w) >= 1.0 || std::abs(sample.y_ - h) >= 1.0) {
+          continue;
+        }
+        double area = footprint(w, IMAGE_W) * footprint(h, IMAGE_H);
+        film.splat(h, w, sample.color_ * static_cast<float>(weight / area));
+      }
+    }
+  }
+  static double footprint(int i, int size) {
+    return i == 0 || i == size - 1 ? 1.0 : 2.0;
+  }
+
+  // The density the chains sample paths in proportion to: luminance raised
+  // to mlt_exponent. Below 1 it spreads the mutations from the emitters in
+  // view toward the dimmer light around them.
+  static double target(Color const& color) {
+    return std::pow(luminance(color), Options::get().mlt_exponent);
+  }
+
+  // The path the sampler's numbers describe, from the image position its
+  // first two pick.
+  static Sample trace(Camera const& camera, MetropolisSampler& sampler) {
+    random_source = &sampler;
+    Sample sample;
+    double dx = sampler.next(), dy = sampler.next();
+    sample.x_ = dx * (IMAGE_W - 1);
+    sample.y_ = dy * (IMAGE_H - 1);
+    sample.color_ =
+        World::traceRay(camera.emitRay(dx, dy, camera.sampleLens()), 0);
+    random_source = nullptr;
+    // Paths whose luminance is not finite would stall a chain.
+    if (!std::isfinite(luminance(sample.color_))) {
+      sample.color_ = Color(0, 0, 0);
+    }
+    return sample;
+  }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#include "aabb.h"
+
+// Radiance leaving diffuse surfaces, averaged over the cells of a uniform
+// grid and stored in a spatial hash keyed on the cell and on which of the
+// six axis directions the surface normal is closest to. Values are stored
+// per unit albedo, i.e. irradiance / PI, so that textures stay sharp.
+class RadianceCache {
+ public:
+  // Smaller cells and more records before a cell is used give higher quality
+  // at a lower hit rate.
+  RadianceCache(double cell_size, int min_records)
+      : cell_size_(cell_size), min_records_(min_records) {}
+
+  // Radiance leaving a surface of the given albedo at p, interpolated
+  // trilinearly between the 8 cells around p that have enough records.
+  // Return false if none has.
+  bool lookup(Point const& p, Direction const& normal, Color const& albedo,
+              Color& radiance) const {
+    double u[3];
+    int base[3];
+    for (int i = 0; i < 3; i++) {
+      u[i] = axis(p, i) / cell_size_ - 0.5;
+      base[i] = static_cast<int>(std::floor(u[i]));
+      u[i] -= base[i];
+    }
+    int bin = normalBin(normal);
+    Color sum(0, 0, 0);
+    double total = 0.0;
+    for (int corner = 0; corner < 8; corner++) {
+      double weight = 1.0;
+      int cell[3];
+      for (int i = 0; i < 3; i++) {
+        bool upper = corner >> i & 1;
+        cell[i] = base[i] + upper;
+        weight *= upper ? u[i] : 1.0 - u[i];
+      }
+      Color cell_value;
+      if (weight > 0.0 && get(key(cell, bin), cell_value)) {
+        sum += cell_value * static_cast<float>(weight);
+        total += weight;
+      }
+    }
+    if (total <= 0.0) {
+      misses_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    radiance = sum * albedo / static_cast<float>(total);
+    return true;
+  }
+
+  void record(Point const& p, Direction const& normal, Color const& albedo,
+              Color const& radiance) {
+    Color value(perAlbedo(radiance.x(), albedo.x()),
+                perAlbedo(radiance.y(), albedo.y()),
+                perAlbedo(radiance.z(), albedo.z()));
+    int cell[3];
+    for (int i = 0; i < 3; i++) {
+      cell[i] = static_cast<int>(std::floor(axis(p, i) / cell_size_));
+    }
+    uint64_t k = key(cell, normalBin(normal));
+    Shard& shard = shards_[k % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    Entry& entry = shard.entries_[k];
+    entry.sum_ += value;
+    entry.count_++;
+  }
+
+  void printStats() const {
+    long long hits = hits_.load(), misses = misses_.load();
+    size_t cells = 0;
+    for (Shard const& shard : shards_) cells += shard.entries_.size();
+    std::cerr << "radiance cache: " << cells << " cells, " << hits
+              << " hits, " << misses << " misses ("
+              << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0)
+              << "% hit rate)" << std::endl;
+  }
+
+ private:
+  struct Entry {
+    Color sum_ = Color(0, 0, 0);
+    int count_ = 0;
+  };
+  struct Shard {
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Entry> entries_;
+  };
+  static constexpr int SHARDS = 64;
+
+  bool get(uint64_t k, Color& value) const {
+    Shard const& shard = shards_[k % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    auto it = shard.entries_.find(k);
+    if (it == shard.entries_.end() || it->second.count_ < min_records_) {
+      return false;
+    }
+    value = it->second.sum_ / static_cast<float>(it->second.count_);
+    return true;
+  }
+
+  static float perAlbedo(float radiance, float albedo) {
+    return albedo > 1e-4f ? radiance / albedo : 0.0f;
+  }
+
+  // Dominant axis of normal and its sign, 0 to 5.
+  static int normalBin(Direction const& normal) {
+    int dim = 0;
+    for (int i = 1; i < 3; i++) {
+      if (std::abs(axis(normal, i)) > std::abs(axis(normal, dim))) dim = i;
+    }
+    return 2 * dim + (axis(normal, dim) < 0);
+  }
+
+  // 20 bits per cell coordinate and 3 for the normal bin, hashed since
+  // unordered_map buckets by the low bits.
+  static uint64_t key(int const* cell, int bin) {
+    uint64_t k = bin;
+    for (int i = 0; i < 3; i++) {
+      k = k << 20 | (static_cast<uint64_t>(cell[i]) & 0xfffff);
+    }
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+  double cell_size_;
+  int min_records_;
+  Shard shards_[SHARDS];
+  mutable std::atomic<long long> hits_{0};
+  mutable std::atomic<long long> misses_{0};
+};
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+#include <algorithm>
+#include <vector>
+
+#include "camera.h"
+#include "parallel.h"
+#include "world.h"
+
+// A point on the surface of an emissive sphere.
+struct LightSample {
+  size_t light_ = 0;
+  Point y_;
+};
+
+// Weighted reservoir over light samples for resampled importance sampling.
+// Candidates are kept with probability proportional to their weight, so the
+// kept sample is distributed roughly as the target function.
+struct Reservoir {
+  LightSample sample_;
+  // Target function of the kept sample at the shading point it serves.
+  double target_ = 0.0;
+  double weight_sum_ = 0.0;
+  // Number of candidates seen, including those merged from other reservoirs.
+  double m_ = 0.0;
+  // Unbiased contribution weight: weight_sum_ / (m_ * target_).
+  double w_ = 0.0;
+
+  void update(LightSample const& sample, double weight, double target) {
+    weight_sum_ += weight;
+    m_ += 1.0;
+    if (weight > 0.0 && rand_double() * weight_sum_ < weight) {
+      sample_ = sample;
+      target_ = target;
+    }
+  }
+
+  // Merge other, whose sample has target function target at this reservoir's
+  // shading point.
+  void merge(Reservoir const& other, double target) {
+    double m = m_;
+    update(other.sample_, target * other.w_ * other.m_, target);
+    m_ = m + other.m_;
+  }
+
+  void finalize() {
+    w_ = target_ > 0.0 ? weight_sum_ / (m_ * target_) : 0.0;
+  }
+};
+
+// Direct lighting with reservoir-based spatiotemporal importance resampling
+// (ReSTIR, Bitterli et al. 2020). Each pass takes one camera path per pixel
+// to its first shading point, streams candidate light samples through a
+// reservoir, then reuses the reservoirs of the previous pass and of nearby
+// pixels before shading with one shadow ray. Light is gathered at that one
+// vertex only, there are no further bounces.
+struct Restir {
+  static void render(Camera& camera, Image& image) {
+    Options const& options = Options::get();
+    std::vector<ShadingPoint> points(IMAGE_W * IMAGE_H);
+    std::vector<Reservoir> current(IMAGE_W * IMAGE_H);
+    std::vector<Reservoir> previous;
+    std::vector<Color> sum(IMAGE_W * IMAGE_H);
+
+    for (int pass = 0; pass < options.restir_passes; pass++) {
+      parallelRows(IMAGE_H, [&](int h) {
+        for (int w = 0; w < IMAGE_W; w++) {
+          int index = h * IMAGE_W + w;
+          double dx = std::clamp((w + rand_double(-1, 1)) / (IMAGE_W - 1),
+                                 0.0, 1.0);
+          double dy = std::clamp((h + rand_double(-1, 1)) / (IMAGE_H - 1),
+                                 0.0, 1.0);
+          ShadingPoint& point = points[index];
+          point = World::findShadingPoint(camera.emitRay(dx, dy));
+          current[index] = initialReservoir(point, options.restir_candidates);
+          if (!previous.empty() && point.valid_) {
+            // Bound the history so that stale samples fade out.
+            Reservoir history = previous[index];
+            history.m_ = std::min(history.m_, 20.0 * options.restir_candidates);
+            current[index].merge(history, target(point, history.sample_));
+            current[index].finalize();
+          }
+        }
+      });
+
+      std::vector<Reservoir> reused(IMAGE_W * IMAGE_H);
+      parallelRows(IMAGE_H, [&](int h) {
+        for (int w = 0; w < IMAGE_W; w++) {
+          int index = h * IMAGE_W + w;
+          ShadingPoint const& point = points[index];
+          Reservoir& reservoir = reused[index];
+          reservoir = current[index];
+          if (point.valid_) {
+            int merged[MAX_SPATIAL + 1] = {index};
+            int merged_cnt = 1;
+            for (int k = 0; k < std::min(options.restir_spatial, MAX_SPATIAL);
+                 k++) {
+              int nw = w + static_cast<int>(rand_double(-1, 1) *
+                                            options.restir_radius);
+              int nh = h + static_cast<int>(rand_double(-1, 1) *
+                                            options.restir_radius);
+              if (nw < 0 || nw >= IMAGE_W || nh < 0 || nh >= IMAGE_H) continue;
+              int neighbor = nh * IMAGE_W + nw;
+              if (!similar(point, points[neighbor])) continue;
+              // A neighbor's sample may be hidden from this pixel, test it
+              // before it can be picked instead of darkening the result.
+              LightSample const& sample = current[neighbor].sample_;
+              double value = target(point, sample);
+              if (value > 0.0 && World::occluded(point.p(), sample.y_)) {
+                value = 0.0;
+              }
+              reservoir.merge(current[neighbor], value);
+              merged[merged_cnt++] = neighbor;
+            }
+            // Normalize by the candidates of the pixels that could have
+            // produced the kept sample, rather than by all of them.
+            double m = 0.0;
+            for (int i = 0; i < merged_cnt; i++) {
+              if (target(points[merged[i]], reservoir.sample_) > 0.0) {
+                m += current[merged[i]].m_;
+              }
+            }
+            reservoir.w_ = reservoir.target_ > 0.0 && m > 0.0
+                               ? reservoir.weight_sum_ / (m * reservoir.target_)
+                               : 0.0;
+          }
+          sum[index] += shade(point, reservoir);
+        }
+      });
+      if (options.restir_temporal) previous = std::move(reused);
+    }
+
+    for (int h = 0; h < IMAGE_H; h++) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        image[h][w] = sum[h * IMAGE_W + w] /
+                      static_cast<float>(options.restir_passes);
+      }
+    }
+  }
+
+ private:
+  static constexpr int MAX_SPATIAL = 32;
+
+  // Light reaching point from sample, before the visibility test, with the
+  // geometry term converting to the area measure shared by all pixels.
+  static Color unshadowed(ShadingPoint const& point,
+                          LightSample const& sample) {
+    Sphere const& light = *World::emitters()[sample.light_];
+    Direction wi = sample.y_ - point.p();
+    double dist_squared = wi.lenSquared();
+    wi = wi / sqrt(dist_squared);
+    HitRecord light_record;
+    light_record.p_ = sample.y_;
+    light_record.normal_ = (sample.y_ - light.center()) / light.radius();
+    light_record.front_face_ = true;
+    double cos_light = -dot(light_record.normal_, wi);
+    if (cos_light <= 0.0) return Color(0, 0, 0);
+    double pdf;
+    Color f = point.eval(wi, pdf);
+    return f * light.material()->emit(light_record) *
+           static_cast<float>(cos_light / dist_squared);
+  }
+
+  static double target(ShadingPoint const& point, LightSample const& sample) {
+    if (!point.valid_) return 0.0;
+    return luminance(unshadowed(point, sample));
+  }
+
+  // Resample candidates drawn by the world's light sampler, then drop the
+  // kept one if it is occluded so that shadowed samples aren't reused.
+  static Reservoir initialReservoir(ShadingPoint const& point,
+                                    int candidates) {
+    Reservoir reservoir;
+    if (!point.valid_ || World::emitters().empty()) return reservoir;
+    for (int i = 0; i < candidates; i++) {
+      double select_pdf, pdf;
+      LightSample sample;
+      sample.light_ = World::selectLight(point.p(), point.normal(), select_pdf);
+      Sphere const& light = *World::emitters()[sample.light_];
+      Direction wi;
+      HitRecord light_record;
+      if (select_pdf <= 0.0 || !light.sampleDirection(point.p(), wi, pdf) ||
+          !light.hit(Ray(point.p(), wi), 1e-3, INF, light_record)) {
+        reservoir.m_ += 1.0;
+        continue;
+      }
+      sample.y_ = light_record.p_;
+      // Solid angle to area density.
+      double cos_light = std::abs(dot(light_record.normal_, wi));
+      double source_pdf = select_pdf * pdf * cos_light /
+                          (light_record.t_ * light_record.t_);
+      double target_value = target(point, sample);
+      reservoir.update(sample, target_value / source_pdf, target_value);
+    }
+    reservoir.finalize();
+    if (reservoir.w_ > 0.0 &&
+        World::occluded(point.p(), reservoir.sample_.y_)) {
+      reservoir.w_ = 0.0;
+    }
+    return reservoir;
+  }
+
+  // Reuse only across similar geometry, otherwise the neighbor's samples
+  // are distributed for the wrong target and the estimate darkens.
+  static bool similar(ShadingPoint const& a, ShadingPoint const& b) {
+    if (!b.valid_ || (a.normal() == nullptr) != (b.normal() == nullptr)) {
+      return false;
+    }
+    if (a.normal() && dot(*a.normal(), *b.normal()) < 0.9) return false;
+    double depth = (a.p() - a.ray_.origin()).len();
+    return (a.p() - b.p()).len() < 0.1 * depth;
+  }
+
+  static Color shade(ShadingPoint const& point, Reservoir const& reservoir) {
+    Color color = point.emitted_;
+    if (!point.valid_ || reservoir.w_ <= 0.0) return color;
+    double transmittance =
+        World::transmittance(point.p(), reservoir.sample_.y_);
+    if (transmittance <= 0.0) return color;
+    return color + point.throughput_ *
+                       unshadowed(point, reservoir.sample_) *
+                       static_cast<float>(reservoir.w_ * transmittance);
+  }
+};
+
+#endif
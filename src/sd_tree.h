@@ -0,0 +1,248 @@
+#ifndef SD_TREE_H
+#define SD_TREE_H
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "aabb.h"
+#include "vec3.h"
+
+// Quadtree over the square [0, 1)^2 of cylindrical direction coordinates
+// (cos theta, phi), which map to directions with the constant Jacobian 4 PI.
+// Each node keeps the energy recorded in each of its quadrants, so sampling
+// descends toward quadrants in proportion to the light arriving from them.
+class DTree {
+ public:
+  DTree() : nodes_(1) {}
+
+  static void toSquare(Direction const& d, double& x, double& y) {
+    x = std::clamp((d.z() + 1.0) * 0.5, 0.0, 1.0 - 1e-12);
+    double phi = atan2(d.y(), d.x());
+    if (phi < 0) phi += 2.0 * PI;
+    y = std::clamp(phi / (2.0 * PI), 0.0, 1.0 - 1e-12);
+  }
+
+  static Direction fromSquare(double x, double y) {
+    double cos_theta = 2.0 * x - 1.0;
+    double sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+    double phi = 2.0 * PI * y;
+    return Direction(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+  }
+
+  double total() const {
+    Node const& root = nodes_[0];
+    return root.sum_[0] + root.sum_[1] + root.sum_[2] + root.sum_[3];
+  }
+
+  void record(Direction const& d, double value) {
+    double x, y;
+    toSquare(d, x, y);
+    size_t node = 0;
+    while (true) {
+      int quadrant = descend(x, y);
+      nodes_[node].sum_[quadrant] += value;
+      if (!nodes_[node].child_[quadrant]) return;
+      node = nodes_[node].child_[quadrant];
+    }
+  }
+
+  // Solid angle density of sample() returning d.
+  double pdf(Direction const& d) const {
+    double total_sum = total();
+    if (total_sum <= 0.0) return 0.0;
+    double x, y;
+    toSquare(d, x, y);
+    double pdf = 1.0;
+    size_t node = 0;
+    while (true) {
+      Node const& n = nodes_[node];
+      double sum = n.sum_[0] + n.sum_[1] + n.sum_[2] + n.sum_[3];
+      int quadrant = descend(x, y);
+      if (sum <= 0.0) return 0.0;
+      pdf *= 4.0 * n.sum_[quadrant] / sum;
+      if (!n.child_[quadrant]) break;
+      node = n.child_[quadrant];
+    }
+    return pdf / (4.0 * PI);
+  }
+
+  Direction sample() const {
+    double x0 = 0.0, y0 = 0.0, size = 1.0;
+    size_t node = 0;
+    while (true) {
+      Node const& n = nodes_[node];
+      double sum = n.sum_[0] + n.sum_[1] + n.sum_[2] + n.sum_[3];
+      double u = rand_double() * sum;
+      int quadrant = 0;
+      while (quadrant < 3 && u >= n.sum_[quadrant]) u -= n.sum_[quadrant++];
+      size *= 0.5;
+      x0 += (quadrant & 1) * size;
+      y0 += (quadrant >> 1) * size;
+      if (!n.child_[quadrant]) break;
+      node = n.child_[quadrant];
+    }
+    return fromSquare(x0 + rand_double() * size, y0 + rand_double() * size);
+  }
+
+  // A tree whose leaves each hold roughly at most threshold of this tree's
+  // energy, with all energies cleared for the next round of recording.
+  DTree refined(double threshold) const {
+    DTree result;
+    double total_sum = total();
+    if (total_sum <= 0.0) return result;
+    result.refine(*this, 0, 0, total_sum, threshold * total_sum, 1);
+    return result;
+  }
+
+ private:
+  static constexpr int MAX_DEPTH = 20;
+
+  struct Node {
+    std::array<double, 4> sum_ = {};
+    // 0 marks a leaf quadrant, the root is never a child.
+    std::array<size_t, 4> child_ = {};
+  };
+
+  // Pick the quadrant of (x, y) and rescale them to that quadrant.
+  static int descend(double& x, double& y) {
+    int quadrant = 0;
+    x *= 2.0;
+    y *= 2.0;
+    if (x >= 1.0) {
+      quadrant |= 1;
+      x -= 1.0;
+    }
+    if (y >= 1.0) {
+      quadrant |= 2;
+      y -= 1.0;
+    }
+    return quadrant;
+  }
+
+  // Mirror node source (or a uniform split of energy when source_node is
+  // 0 past the depth of source) into node of this tree.
+  void refine(DTree const& source, size_t source_node, size_t node,
+              double energy, double threshold, int depth) {
+    for (int i = 0; i < 4; i++) {
+      double child_energy;
+      size_t child_source = 0;
+      if (source_node || node == 0) {
+        child_energy = source.nodes_[source_node].sum_[i];
+        child_source = source.nodes_[source_node].child_[i];
+      } else {
+        child_energy = energy / 4.0;
+      }
+      if (child_energy > threshold && depth < MAX_DEPTH) {
+        size_t child = nodes_.size();
+        nodes_.emplace_back();
+        nodes_[node].child_[i] = child;
+        refine(source, child_source, child, child_energy, threshold, depth + 1);
+      }
+    }
+  }
+
+  std::vector<Node> nodes_;
+};
+
+// Spatial binary tree over the scene whose leaves each hold a directional
+// tree, following Müller et al., "Practical Path Guiding". Leaves sample from
+// the distribution learned in the previous pass while recording the current
+// one, and both trees are refined between passes.
+class SDTree {
+ public:
+  explicit SDTree(Aabb const& bounds) : bounds_(bounds), nodes_(1) {
+    nodes_[0].leaf_ = std::make_unique<Leaf>();
+  }
+
+  // Leaf covering p, which is clamped into the tree's bounds.
+  struct Leaf {
+    DTree sampling_;
+    DTree building_;
+    long long records_ = 0;
+    Aabb points_;
+    std::mutex mutex_;
+  };
+
+  Leaf& leaf(Point const& p) {
+    Point q(std::clamp(p.x(), bounds_.min_.x(), bounds_.max_.x()),
+            std::clamp(p.y(), bounds_.min_.y(), bounds_.max_.y()),
+            std::clamp(p.z(), bounds_.min_.z(), bounds_.max_.z()));
+    Aabb box = bounds_;
+    size_t node = 0;
+    while (!nodes_[node].leaf_) {
+      int dim = nodes_[node].axis_;
+      double mid = 0.5 * (axis(box.min_, dim) + axis(box.max_, dim));
+      bool upper = axis(q, dim) >= mid;
+      setAxis(upper ? box.min_ : box.max_, dim, mid);
+      node = nodes_[node].child_[upper];
+    }
+    return *nodes_[node].leaf_;
+  }
+
+  void record(Point const& p, Direction const& d, double value) {
+    if (!(value > 0.0) || !std::isfinite(value)) return;
+    Leaf& l = leaf(p);
+    std::lock_guard<std::mutex> lock(l.mutex_);
+    l.building_.record(d, value);
+    l.records_++;
+    if (nodes_.size() == 1) l.points_.grow(p);
+  }
+
+  // Split leaves that recorded more than spatial_threshold samples, then
+  // swap in the recorded distributions for sampling.
+  void refine(long long spatial_threshold, double directional_threshold) {
+    // Until the first split, shrink the root to where records landed. The
+    // scene's own bounds include the ground sphere, 2000 units wide.
+    if (nodes_.size() == 1 && !nodes_[0].leaf_->points_.empty()) {
+      bounds_ = nodes_[0].leaf_->points_;
+    }
+    for (size_t node = 0; node < nodes_.size(); node++) {
+      if (!nodes_[node].leaf_ || nodes_[node].depth_ >= MAX_DEPTH) continue;
+      Leaf& l = *nodes_[node].leaf_;
+      if (l.records_ <= spatial_threshold) continue;
+      // Both halves start from the parent's distribution with half the
+      // records, and may split again in this loop.
+      for (int i = 0; i < 2; i++) {
+        size_t child = nodes_.size();
+        nodes_.emplace_back();
+        nodes_[child].axis_ = (nodes_[node].axis_ + 1) % 3;
+        nodes_[child].depth_ = nodes_[node].depth_ + 1;
+        nodes_[child].leaf_ = std::make_unique<Leaf>();
+        nodes_[child].leaf_->building_ = l.building_;
+        nodes_[child].leaf_->records_ = l.records_ / 2;
+        nodes_[node].child_[i] = child;
+      }
+      nodes_[node].leaf_.reset();
+    }
+    for (Node& node : nodes_) {
+      if (!node.leaf_) continue;
+      Leaf& l = *node.leaf_;
+      if (l.building_.total() > 0.0) l.sampling_ = l.building_;
+      l.building_ = l.sampling_.refined(directional_threshold);
+      l.records_ = 0;
+    }
+  }
+
+ private:
+  static constexpr int MAX_DEPTH = 60;
+
+  struct Node {
+    std::unique_ptr<Leaf> leaf_;
+    int axis_ = 0;
+    int depth_ = 0;
+    std::array<size_t, 2> child_ = {};
+  };
+
+  static void setAxis(Point& p, int dim, double value) {
+    p = Point(dim == 0 ? value : p.x(), dim == 1 ? value : p.y(),
+              dim == 2 ? value : p.z());
+  }
+
+  Aabb bounds_;
+  std::vector<Node> nodes_;
+};
+
+#endif
@@ -11,6 +11,42 @@ class Sphere : public Hittable {
       : center_(center), radius_(radius), material_(material) {}
 
   Point center() const { return center_; }
+  double radius() const { return radius_; }
+  std::shared_ptr<Material> const& material() const { return material_; }
+
+  // Sample a direction from p uniformly within the cone subtended by the
+  // sphere. Return false if p is inside the sphere, where there is no cone.
+  bool sampleDirection(Point const& p, Direction& direction,
+                       double& pdf) const {
+    Direction to_center = center_ - p;
+    double dist_squared = to_center.lenSquared();
+    double radius_squared = radius_ * radius_;
+    if (dist_squared <= radius_squared) return false;
+    // 1 - cos_max computed without cancellation for small and far spheres.
+    double sin_max_squared = radius_squared / dist_squared;
+    double cos_max = sqrt(1.0 - sin_max_squared);
+    double one_minus_cos_max = sin_max_squared / (1.0 + cos_max);
+
+    double cos_theta = 1.0 - rand_double() * one_minus_cos_max;
+    double sin_theta = sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+    double phi = 2.0 * PI * rand_double();
+    Direction w = to_center / sqrt(dist_squared), u, v;
+    orthonormalBasis(w, u, v);
+    direction = (sin_theta * cos(phi)) * u + (sin_theta * sin(phi)) * v +
+                cos_theta * w;
+    pdf = 1.0 / (2.0 * PI * one_minus_cos_max);
+    return true;
+  }
+
+  // Density of sampleDirection() returning any direction within the cone.
+  double directionPdf(Point const& p) const {
+    double dist_squared = (center_ - p).lenSquared();
+    double radius_squared = radius_ * radius_;
+    if (dist_squared <= radius_squared) return 0.0;
+    double sin_max_squared = radius_squared / dist_squared;
+    double cos_max = sqrt(1.0 - sin_max_squared);
+    return 1.0 / (2.0 * PI * sin_max_squared / (1.0 + cos_max));
+  }
   bool hit(Ray const& ray, double t_min, double t_max,
            HitRecord& hit_record) const override {
     Direction oc = ray.origin() - center_;
@@ -31,6 +67,7 @@ class Sphere : public Hittable {
     Direction outward_normal = (hit_record.p_ - center_) / radius_;
     hit_record.setFaceNormal(ray, outward_normal);
     hit_record.material_ = material_;
+    hit_record.hittable_ = this;
 
     return true;
   }
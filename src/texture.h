@@ -2,8 +2,10 @@
 #define TEXTTURE_H
 #include <cassert>
 #include <cmath>
+#include <iostream>
 #include <string_view>
 #include <utility>
+#include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -14,6 +16,15 @@ class Texture {
   // Pass in a unit normal vector and return the corresponding color mapping of
   // the object.
   virtual Color getColor(Point p) = 0;
+  // The color averaged over the whole surface.
+  virtual Color average() const = 0;
+  // The color at p prefiltered to mip level, 0 being getColor() and each
+  // level halving the resolution. Levels past the coarsest, such as
+  // AVERAGE_LEVEL, give average() without computing any texture coordinates.
+  virtual Color getColorAtLevel(Point p, int level) {
+    return level == 0 ? getColor(p) : average();
+  }
+  static constexpr int AVERAGE_LEVEL = 64;
   virtual ~Texture() = default;
 
  protected:
@@ -35,6 +46,7 @@ class CheckerTexture : public Texture {
     }
     return Color(0.0, 0.0, 0.0);
   }
+  virtual Color average() const override { return Color(0.5, 0.5, 0.5); }
 
  private:
   // return 1 if x is odd, -1 if x is even.
@@ -50,6 +62,7 @@ class ConstTexture : public Texture {
   ConstTexture(Color const& color) : color_(color) {}
   virtual ~ConstTexture() = default;
   virtual Color getColor(Point p) override { return color_; }
+  virtual Color average() const override { return color_; }
 
  private:
   Color color_;
@@ -61,6 +74,21 @@ class ImageTexture : public Texture {
     int components_per_pixel = bytes_per_pixel;
     data = stbi_load(filename, &width, &height, &components_per_pixel,
                      components_per_pixel);
+    if (!data) {
+      // Render on with one magenta texel, which stands out in the image.
+      std::cerr << "cannot load " << filename << ": " << stbi_failure_reason()
+                << std::endl;
+      data = missing_;
+      width = height = 1;
+    }
+    // Sum in double, a float loses precision over millions of texels.
+    double sum[bytes_per_pixel] = {};
+    for (int i = 0; i < width * height * bytes_per_pixel; i++) {
+      sum[i % bytes_per_pixel] += data[i];
+    }
+    double scale = 1.0 / (255.0 * width * height);
+    average_ = Color(sum[0] * scale, sum[1] * scale, sum[2] * scale);
+    buildMips();
   }
   virtual Color getColor(Point p) override {
     auto [u, v] = Texture::xyz2uv(p);
@@ -72,10 +100,57 @@ class ImageTexture : public Texture {
     return Color(color_scale * pixel[0], color_scale * pixel[1],
                  color_scale * pixel[2]);
   }
+  virtual Color average() const override { return average_; }
+  virtual Color getColorAtLevel(Point p, int level) override {
+    if (level == 0) return getColor(p);
+    if (level > static_cast<int>(mips_.size())) return average_;
+    Mip const& mip = mips_[level - 1];
+    auto [u, v] = Texture::xyz2uv(p);
+    int i = std::min(static_cast<int>(u * mip.width_), mip.width_ - 1);
+    int j = std::min(static_cast<int>(v * mip.height_), mip.height_ - 1);
+    return mip.texels_[j * mip.width_ + i];
+  }
 
  private:
+  struct Mip {
+    int width_, height_;
+    std::vector<Color> texels_;
+  };
+
+  // Box filter the image down by halves while both sides are at least 2.
+  void buildMips() {
+    int w = width, h = height;
+    auto texel = [&](int i, int j) {
+      if (mips_.empty()) {
+        unsigned char* pixel = data + (j * width + i) * bytes_per_pixel;
+        return Color(pixel[0], pixel[1], pixel[2]) / 255.0f;
+      }
+      return mips_.back().texels_[j * w + i];
+    };
+    while (w >= 2 && h >= 2) {
+      Mip mip{w / 2, h / 2, {}};
+      mip.texels_.reserve(mip.width_ * mip.height_);
+      for (int j = 0; j < mip.height_; j++) {
+        for (int i = 0; i < mip.width_; i++) {
+          mip.texels_.push_back((texel(2 * i, 2 * j) + texel(2 * i + 1, 2 * j) +
+                                 texel(2 * i, 2 * j + 1) +
+                                 texel(2 * i + 1, 2 * j + 1)) *
+                                0.25f);
+        }
+      }
+      mips_.push_back(std::move(mip));
+      w = mips_.back().width_;
+      h = mips_.back().height_;
+    }
+  }
+
   int width, height;
   unsigned char* data;
+  // Shared, so that copies of a texture that fell back to it stay valid.
+  static inline unsigned char missing_[3] = {255, 0, 255};
+  Color average_;
+  // Level 1 onward.
+  std::vector<Mip> mips_;
   static constexpr int bytes_per_pixel = 3;
 };
 
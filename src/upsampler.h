@@ -0,0 +1,130 @@
+#ifndef UPSAMPLER_H
+#define UPSAMPLER_H
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "background.h"
+#include "camera.h"
+#include "parallel.h"
+#include "world.h"
+
+// Joint bilateral upsampling (Kopf et al. 2007) of an image rendered in
+// blocks of factor x factor pixels, one color per block, to full resolution.
+// The guides are the first-hit normal and albedo of one ray from the lens
+// center through each pixel's center, and for a block the mean of its
+// pixels'. Each pixel
+// blends the 4 x 4 blocks around it, weighted by a Gaussian of their
+// distance in blocks and by
+//   exp(-(1 - normal cosine) / SIGMA_NORMAL -
+//       |albedo difference|_1 / SIGMA_ALBEDO),
+// falling back to the distance alone where no block resembles it.
+class JointBilateralUpsampler {
+ public:
+  explicit JointBilateralUpsampler(int factor)
+      : factor_(std::max(1, factor)),
+        width_((IMAGE_W + factor_ - 1) / factor_),
+        height_((IMAGE_H + factor_ - 1) / factor_),
+        normals_(IMAGE_W * IMAGE_H),
+        albedos_(IMAGE_W * IMAGE_H),
+        block_normals_(width_ * height_),
+        block_albedos_(width_ * height_) {}
+
+  // Blocks across and down, the size of the image to upsample.
+  int factor() const { return factor_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // The guides, from one pinhole ray per pixel and no bounces, so the same
+  // every time. Misses have the normal against the ray and the background's
+  // color as albedo.
+  void traceGuides(Camera const& camera) {
+    parallelRows(IMAGE_H, [&](int h) {
+      for (int w = 0; w < IMAGE_W; w++) {
+        Ray ray = camera.emitRay(static_cast<double>(w) / (IMAGE_W - 1),
+                                 static_cast<double>(h) / (IMAGE_H - 1),
+                                 camera.lensCenter());
+        HitRecord hit_record;
+        int i = h * IMAGE_W + w;
+        if (World::intersect(ray, hit_record)) {
+          normals_[i] = hit_record.normal_;
+          albedos_[i] = hit_record.material_->albedo(hit_record);
+        } else {
+          normals_[i] = -ray.direction().normalize();
+          albedos_[i] = Background::color(ray);
+        }
+      }
+    });
+    parallelRows(height_, [&](int y) {
+      for (int x = 0; x < width_; x++) {
+        Direction normal(0, 0, 0);
+        Color albedo(0, 0, 0);
+        int pixels = 0;
+        for (int h = y * factor_; h < std::min(IMAGE_H, (y + 1) * factor_);
+             h++) {
+          for (int w = x * factor_; w < std::min(IMAGE_W, (x + 1) * factor_);
+               w++) {
+            normal += normals_[h * IMAGE_W + w];
+            albedo += albedos_[h * IMAGE_W + w];
+            pixels++;
+          }
+        }
+        if (normal.nearZero()) normal = Direction(0, 1, 0);
+        block_normals_[y * width_ + x] = normal.normalize();
+        block_albedos_[y * width_ + x] = albedo / static_cast<float>(pixels);
+      }
+    });
+  }
+
+  // Upsample blocks, width() x height() row by row, into image.
+  void upsample(std::vector<Color> const& blocks, Image& image) const {
+    parallelRows(IMAGE_H, [&](int h) {
+      double y = (h + 0.5) / factor_ - 0.5;
+      int top = static_cast<int>(std::floor(y));
+      for (int w = 0; w < IMAGE_W; w++) {
+        double x = (w + 0.5) / factor_ - 0.5;
+        int left = static_cast<int>(std::floor(x));
+        Direction const& normal = normals_[h * IMAGE_W + w];
+        Color const& albedo = albedos_[h * IMAGE_W + w];
+        Color guided(0, 0, 0), spatial(0, 0, 0);
+        double guided_total = 0.0, spatial_total = 0.0;
+        for (int i = std::max(0, top - 1); i <= std::min(height_ - 1, top + 2);
+             i++) {
+          for (int j = std::max(0, left - 1);
+               j <= std::min(width_ - 1, left + 2); j++) {
+            int b = i * width_ + j;
+            Color const& color = blocks[b];
+            double distance2 = (i - y) * (i - y) + (j - x) * (j - x);
+            double weight = std::exp(-0.5 * distance2);
+            spatial += color * static_cast<float>(weight);
+            spatial_total += weight;
+            Color difference = albedo - block_albedos_[b];
+            weight *= std::exp(
+                -(1.0 - dot(normal, block_normals_[b])) / SIGMA_NORMAL -
+                (std::abs(difference.x()) + std::abs(difference.y()) +
+                 std::abs(difference.z())) /
+                    SIGMA_ALBEDO);
+            guided += color * static_cast<float>(weight);
+            guided_total += weight;
+          }
+        }
+        image[h][w] = guided_total > 1e-3 * spatial_total
+                          ? guided / static_cast<float>(guided_total)
+                          : spatial / static_cast<float>(spatial_total);
+      }
+    });
+  }
+
+ private:
+  static constexpr double SIGMA_NORMAL = 0.1;
+  static constexpr double SIGMA_ALBEDO = 0.1;
+
+  int factor_, width_, height_;
+  // Per pixel, then per block.
+  std::vector<Direction> normals_;
+  std::vector<Color> albedos_;
+  std::vector<Direction> block_normals_;
+  std::vector<Color> block_albedos_;
+};
+
+#endif
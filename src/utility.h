@@ -2,12 +2,38 @@
 #define UTILITY_H
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <random>
 
 constexpr double INF = DBL_MAX;
 constexpr double PI = M_PI;
 
-double rand_double() { return rand() / (RAND_MAX + 1.0); }
+// Where rand_double() gets its numbers on the current thread, for integrators
+// that replay or mutate the random numbers of a path. Null means rand().
+struct RandomSource {
+  virtual ~RandomSource() = default;
+  // A uniform number in [0, 1).
+  virtual double next() = 0;
+};
+thread_local RandomSource* random_source = nullptr;
+
+// Random numbers from a 64-bit Mersenne twister with a fixed seed, for
+// renders that must draw the same numbers every time.
+class StreamSource : public RandomSource {
+ public:
+  explicit StreamSource(uint64_t seed) : rng_(seed) {}
+  double next() override { return uniform_(rng_); }
+
+ private:
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> uniform_;
+};
+
+double rand_double() {
+  if (random_source) return random_source->next();
+  return rand() / (RAND_MAX + 1.0);
+}
 
 double rand_double(double min, double max) {
   return min + (max - min) * rand_double();
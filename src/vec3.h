@@ -82,11 +82,13 @@ class Vec3 {
     return (std::abs(x()) < threshhold) && (std::abs(y()) < threshhold) &&
            (std::abs(z()) < threshhold);
   }
+  // Uniform on the unit sphere, so that scattering matches the analytic
+  // phase function and BRDF used when sampling lights directly.
   static Vec3 rand_unit_vec() {
-    Vec3 vec;
-    while (vec.nearZero())
-      vec = Vec3(rand() % 101 - 50, rand() % 101 - 50, rand() % 101 - 50);
-    return vec.normalize();
+    double z = 1.0 - 2.0 * rand_double();
+    double r = sqrt(std::max(0.0, 1.0 - z * z));
+    double phi = 2.0 * PI * rand_double();
+    return Vec3(r * cos(phi), r * sin(phi), z);
   }
 
   static Vec3 rand_unit_vec_in_xy_plane() {
@@ -95,6 +97,12 @@ class Vec3 {
     return vec.normalize();
   }
 
+  static Vec3 rand_in_unit_disk() {
+    double r = sqrt(rand_double());
+    double phi = 2.0 * PI * rand_double();
+    return Vec3(r * cos(phi), r * sin(phi), 0);
+  }
+
   static Vec3 random() {
     return Vec3(rand_double(), rand_double(), rand_double());
   }
@@ -165,6 +173,14 @@ Vec3<T> refract(Vec3<T> const &in, Vec3<T> const &n, double refraction_ratio) {
   return out_perpendicular + out_parallel;
 }
 
+// Complete the unit vector w into an orthonormal basis (u, v, w).
+template <typename T>
+void orthonormalBasis(Vec3<T> const &w, Vec3<T> &u, Vec3<T> &v) {
+  Vec3<T> a = std::abs(w.x()) > 0.9 ? Vec3<T>(0, 1, 0) : Vec3<T>(1, 0, 0);
+  v = cross(w, a).normalize();
+  u = cross(v, w);
+}
+
 using Point = Vec3<double>;
 using Direction = Vec3<double>;
 // Considered using u_int8_t for color type here, but there is concern
@@ -172,4 +188,9 @@ using Direction = Vec3<double>;
 // Each element should be a float between [0.0, 1.0]
 using Color = Vec3<float>;
 
+// Perceived brightness of a linear RGB color.
+static double luminance(Color const &c) {
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 #endif
\ No newline at end of file
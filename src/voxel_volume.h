@@ -0,0 +1,292 @@
+#ifndef VOXEL_VOLUME_H
+#define VOXEL_VOLUME_H
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "aabb.h"
+#include "ray.h"
+#include "utility.h"
+
+// Extinction varying over a box, stored per voxel and interpolated
+// trilinearly. Free flights are sampled by delta tracking and transmittance
+// is estimated by ratio tracking (Novák et al. 2014), both against a coarse
+// grid of majorants, the largest extinction within each block of
+// BLOCK ^ 3 voxels, traversed by a 3D DDA. Both are unbiased and only look
+// up the density at tentative collisions, whose count follows the majorant
+// rather than a step size. Outside the box the extinction is 0.
+//
+// With a positive march step, both queries instead march through the box
+// at that fixed step, a biased baseline to compare costs against.
+class VoxelVolume {
+ public:
+  static constexpr int BLOCK = 8;
+
+  // Sample density(p) at the center of each of nx * ny * nz voxels over
+  // bounds.
+  template <typename Density>
+  VoxelVolume(Aabb const& bounds, int nx, int ny, int nz,
+              Density const& density, double march_step = 0.0)
+      : bounds_(bounds), n_{nx, ny, nz}, march_step_(march_step) {
+    for (int i = 0; i < 3; i++) {
+      voxel_[i] = axis(bounds_.diagonal(), i) / n_[i];
+      blocks_[i] = (n_[i] + BLOCK - 1) / BLOCK;
+    }
+    density_.resize(static_cast<size_t>(nx) * ny * nz);
+    for (int z = 0; z < nz; z++) {
+      for (int y = 0; y < ny; y++) {
+        for (int x = 0; x < nx; x++) {
+          Point p = bounds_.min_ + Direction((x + 0.5) * voxel_[0],
+                                             (y + 0.5) * voxel_[1],
+                                             (z + 0.5) * voxel_[2]);
+          density_[index(x, y, z)] = std::max(0.0, density(p));
+        }
+      }
+    }
+    buildMajorants();
+  }
+
+  // Trilinearly interpolated extinction at p.
+  double density(Point const& p) const {
+    if (!bounds_.contains(p)) return 0.0;
+    int base[3];
+    double u[3];
+    for (int i = 0; i < 3; i++) {
+      double v = (axis(p, i) - axis(bounds_.min_, i)) / voxel_[i] - 0.5;
+      base[i] = static_cast<int>(std::floor(v));
+      u[i] = v - base[i];
+    }
+    double sum = 0.0;
+    for (int corner = 0; corner < 8; corner++) {
+      double weight = 1.0;
+      int c[3];
+      for (int i = 0; i < 3; i++) {
+        bool upper = corner >> i & 1;
+        c[i] = std::clamp(base[i] + upper, 0, n_[i] - 1);
+        weight *= upper ? u[i] : 1.0 - u[i];
+      }
+      sum += weight * density_[index(c[0], c[1], c[2])];
+    }
+    return sum;
+  }
+
+  // Distance along ray, whose direction is a unit vector, to a collision
+  // before t_max, INF if there is none.
+  double sampleDistance(Ray const& ray, double t_max) const {
+    int lookups = 0;
+    double result = INF;
+    if (march_step_ > 0.0) {
+      // March until the optical depth reaches a sampled threshold.
+      double threshold = -std::log(1.0 - rand_double());
+      march(ray, t_max, [&](double t, double step) {
+        lookups++;
+        double tau = density(ray.at(t + 0.5 * step)) * step;
+        if (tau < threshold) {
+          threshold -= tau;
+          return true;
+        }
+        result = t + step * threshold / tau;
+        return false;
+      });
+    } else {
+      traverse(ray, t_max, [&](double t0, double t1, double majorant) {
+        if (majorant <= 0.0) return true;
+        for (double t = t0;;) {
+          t -= std::log(1.0 - rand_double()) / majorant;
+          if (t >= t1) return true;
+          lookups++;
+          // A real collision, or a null one that goes on.
+          if (rand_double() * majorant < density(ray.at(t))) {
+            result = t;
+            return false;
+          }
+        }
+      });
+    }
+    count(lookups);
+    return result;
+  }
+
+  // Unbiased estimate of the transmittance along ray, whose direction is a
+  // unit vector, up to t_max.
+  double transmittance(Ray const& ray, double t_max) const {
+    int lookups = 0;
+    double result = 1.0;
+    if (march_step_ > 0.0) {
+      double tau = 0.0;
+      march(ray, t_max, [&](double t, double step) {
+        lookups++;
+        tau += density(ray.at(t + 0.5 * step)) * step;
+        return true;
+      });
+      result = std::exp(-tau);
+    } else {
+      traverse(ray, t_max, [&](double t0, double t1, double majorant) {
+        if (majorant <= 0.0) return true;
+        for (double t = t0;;) {
+          t -= std::log(1.0 - rand_double()) / majorant;
+          if (t >= t1) return true;
+          lookups++;
+          result *= 1.0 - density(ray.at(t)) / majorant;
+          // Little is left to lose: stop by Russian roulette.
+          if (result < 0.1) {
+            if (rand_double() >= result) {
+              result = 0.0;
+              return false;
+            }
+            result = 1.0;
+          }
+        }
+      });
+    }
+    count(lookups);
+    return result;
+  }
+
+  size_t memoryBytes() const {
+    return density_.size() * sizeof(float) +
+           majorants_.size() * sizeof(float);
+  }
+
+  void printStats() const {
+    long long queries = queries_.load(), lookups = lookups_.load();
+    std::cerr << "fog volume: " << n_[0] << "x" << n_[1] << "x" << n_[2]
+              << " voxels, " << density_.size() * sizeof(float) / 1024
+              << " KB of densities and "
+              << majorants_.size() * sizeof(float) << " bytes of majorants; "
+              << queries << " queries, "
+              << (queries ? double(lookups) / queries : 0.0)
+              << " density lookups per query ("
+              << (march_step_ > 0.0 ? "ray marching" : "delta/ratio tracking")
+              << ")" << std::endl;
+  }
+
+ private:
+  size_t index(int x, int y, int z) const {
+    return (static_cast<size_t>(z) * n_[1] + y) * n_[0] + x;
+  }
+
+  // The majorant of a block covers the voxels around it too, which the
+  // interpolation reaches into.
+  void buildMajorants() {
+    majorants_.assign(static_cast<size_t>(blocks_[0]) * blocks_[1] *
+                          blocks_[2],
+                      0.0f);
+    for (int bz = 0; bz < blocks_[2]; bz++) {
+      for (int by = 0; by < blocks_[1]; by++) {
+        for (int bx = 0; bx < blocks_[0]; bx++) {
+          float majorant = 0.0f;
+          int b[3] = {bx, by, bz}, lo[3], hi[3];
+          for (int i = 0; i < 3; i++) {
+            lo[i] = std::max(0, b[i] * BLOCK - 1);
+            hi[i] = std::min(n_[i] - 1, (b[i] + 1) * BLOCK);
+          }
+          for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+              for (int x = lo[0]; x <= hi[0]; x++) {
+                majorant = std::max(majorant, density_[index(x, y, z)]);
+              }
+            }
+          }
+          majorants_[(static_cast<size_t>(bz) * blocks_[1] + by) *
+                         blocks_[0] +
+                     bx] = majorant;
+        }
+      }
+    }
+  }
+
+  // Parameters where ray enters and leaves the box, false if it misses it
+  // before t_max.
+  bool clip(Ray const& ray, double t_max, double& t0, double& t1) const {
+    t0 = 0.0;
+    t1 = t_max;
+    for (int i = 0; i < 3; i++) {
+      double inv = 1.0 / axis(ray.direction(), i);
+      double near = (axis(bounds_.min_, i) - axis(ray.origin(), i)) * inv;
+      double far = (axis(bounds_.max_, i) - axis(ray.origin(), i)) * inv;
+      if (near > far) std::swap(near, far);
+      t0 = std::max(t0, near);
+      t1 = std::min(t1, far);
+      if (t0 > t1) return false;
+    }
+    return true;
+  }
+
+  // Call visit(t0, t1, majorant) for each block ray crosses before t_max, in
+  // order, until it returns false.
+  template <typename Visit>
+  void traverse(Ray const& ray, double t_max, Visit const& visit) const {
+    double t0, t1;
+    if (!clip(ray, t_max, t0, t1)) return;
+    int cell[3], step[3];
+    double next[3], delta[3];
+    Point entry = ray.at(t0);
+    for (int i = 0; i < 3; i++) {
+      double size = voxel_[i] * BLOCK;
+      double d = axis(ray.direction(), i);
+      double offset = (axis(entry, i) - axis(bounds_.min_, i)) / size;
+      cell[i] = std::clamp(static_cast<int>(offset), 0, blocks_[i] - 1);
+      if (d > 0) {
+        step[i] = 1;
+        delta[i] = size / d;
+        next[i] = t0 + ((cell[i] + 1) * size + axis(bounds_.min_, i) -
+                        axis(entry, i)) / d;
+      } else if (d < 0) {
+        step[i] = -1;
+        delta[i] = -size / d;
+        next[i] = t0 + (cell[i] * size + axis(bounds_.min_, i) -
+                        axis(entry, i)) / d;
+      } else {
+        step[i] = 0;
+        delta[i] = INF;
+        next[i] = INF;
+      }
+    }
+    double t = t0;
+    while (t < t1) {
+      int i = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                : (next[1] < next[2] ? 1 : 2);
+      double exit = std::min(next[i], t1);
+      float majorant =
+          majorants_[(static_cast<size_t>(cell[2]) * blocks_[1] + cell[1]) *
+                         blocks_[0] +
+                     cell[0]];
+      if (!visit(t, exit, majorant)) return;
+      t = exit;
+      cell[i] += step[i];
+      if (cell[i] < 0 || cell[i] >= blocks_[i]) return;
+      next[i] += delta[i];
+    }
+  }
+
+  // Call visit(t, step) for each fixed step through the box before t_max,
+  // the last one shortened, until it returns false.
+  template <typename Visit>
+  void march(Ray const& ray, double t_max, Visit const& visit) const {
+    double t0, t1;
+    if (!clip(ray, t_max, t0, t1)) return;
+    for (double t = t0; t < t1; t += march_step_) {
+      if (!visit(t, std::min(march_step_, t1 - t))) return;
+    }
+  }
+
+  void count(int lookups) const {
+    queries_.fetch_add(1, std::memory_order_relaxed);
+    lookups_.fetch_add(lookups, std::memory_order_relaxed);
+  }
+
+  Aabb bounds_;
+  int n_[3];
+  int blocks_[3];
+  double voxel_[3];
+  double march_step_;
+  std::vector<float> density_;
+  std::vector<float> majorants_;
+  mutable std::atomic<long long> queries_{0};
+  mutable std::atomic<long long> lookups_{0};
+};
+
+#endif
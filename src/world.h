@@ -1,57 +1,838 @@
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "background.h"
+#include "alias_table.h"
+#include "aov.h"
 #include "hittable.h"
+#include "light_tree.h"
 #include "material.h"
+#include "medium.h"
+#include "options.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
 #include "ray.h"
+#include "sd_tree.h"
 #include "sphere.h"
 #include "vec3.h"
+#include "voxel_volume.h"
 
 constexpr int MAX_REFLECTION = 50;
 
+// A non-specular vertex that a path was scattered from. Emission hit by the
+// scattered ray is weighted against sampling the lights at this vertex.
+struct ScatterVertex {
+  Point p_;
+  Direction normal_;
+  // False in the fog, where there is no surface.
+  bool has_normal_;
+  // Solid angle density of the scattered direction.
+  double pdf_;
+
+  Direction const* normal() const { return has_normal_ ? &normal_ : nullptr; }
+};
+
+// A ray segment through the fog to the surface it hits, whose light
+// scattered by the fog toward the ray's origin is estimated both at the
+// scattering vertices distance sampling picks and by equiangular samples
+// toward the emitters, combined by the balance heuristic.
+struct FogSegment {
+  // From the ray's origin along its unit direction, to the surface.
+  Ray ray_;
+  double length_ = 0.0;
+  // Distance sampling picks vertices with distance_scale_ times the fog's
+  // free-flight density, and equiangular_samples_ samples are taken.
+  double distance_scale_ = 1.0;
+  int equiangular_samples_ = 1;
+  // Sum of World::equiangularWeight() over the emitters.
+  double light_weight_ = 0.0;
+};
+
+// The fog's phase function for light traveling along d_, as the BSDF of
+// light sampling with no other strategy to weight against.
+struct PhaseOnly {
+  HomogeneousMedium const& medium_;
+  Direction d_;
+
+  Color operator()(Direction const& wi, double& pdf) const {
+    float phase = medium_.phase(d_, wi);
+    pdf = 0.0;
+    return Color(phase, phase, phase);
+  }
+};
+
+// Radiance arriving at a point from a sampled direction, divided by the
+// density of sampling that direction.
+struct IncidentSample {
+  Direction wi_;
+  Color radiance_;
+};
+
+// The first vertex of a camera path where light sampling applies: a
+// non-specular surface or a scattering particle in the fog.
+struct ShadingPoint {
+  // False if the path escaped or was absorbed before reaching such a vertex.
+  bool valid_ = false;
+  Ray ray_;
+  // material_ is null for a vertex in the fog.
+  HitRecord hit_record_;
+  // Attenuation through the specular vertices before this one.
+  Color throughput_ = Color(1, 1, 1);
+  // Light the path collected before reaching this vertex.
+  Color emitted_;
+
+  Point p() const { return hit_record_.p_; }
+  Direction const* normal() const {
+    return hit_record_.material_ ? &hit_record_.normal_ : nullptr;
+  }
+  // BSDF or phase function times cosine for the unit direction wi, with pdf
+  // set to the density of scattering into wi.
+  Color eval(Direction const& wi, double& pdf) const;
+};
+
+// Where a path stands relative to the caustic photon map, which holds the
+// light reaching the first diffuse surface a camera path meets through
+// specular surfaces.
+enum class CausticPath {
+  // Only specular vertices since the camera: gather at the next diffuse one.
+  CAMERA,
+  // Leaving the diffuse vertex that gathered.
+  GATHERED,
+  // Specular vertices since gathering: emission found now is in the map.
+  IN_MAP,
+  // None of the above.
+  NONE,
+};
+
 struct World {
-  static Color traceRay(Ray const& ray, int reflections) {
+  // from is the vertex the ray was scattered from, null for camera rays and
+  // rays leaving specular surfaces, which can only find emitters by hitting
+  // them.
+  static Color traceRay(Ray const& ray, int reflections,
+                        ScatterVertex const* from = nullptr,
+                        CausticPath caustic = CausticPath::CAMERA) {
     if (reflections > MAX_REFLECTION) {
       return Color(0, 0, 0);
     }
 
-    Ray scattered;
-    double t = randomScatter(ray, scattered);
     HitRecord hit_record;
-    if (world.hit(ray, 1e-3, INF, hit_record)) {
-      // Scatterred by random particles before hitting anything.
-      if (hit_record.t_ > t) {
-        return 0.9f * traceRay(scattered, reflections + 1);
+    if (!world.hit(ray, 1e-3, INF, hit_record)) {
+      Color background = Background::color(ray);
+      if (from && Background::environment()) {
+        background *= static_cast<float>(environmentWeight(ray, *from));
       }
-      Color attenuation;
-      Color emitted = hit_record.material_->emit(hit_record);
+      if (aov_sample) returnDirect(reflections, background);
+      return background;
+    }
+    hit_record.texture_level_ = textureLevel(reflections);
+    if (aov_sample && reflections == 0) recordFirstHit(ray, hit_record);
+    bool nee = Options::get().next_event_estimation &&
+               (!lights.empty() || Background::environment());
+    int max_split = Options::get().primary_split;
+    // Splitting and equiangular sampling assume the homogeneous fog.
+    if (max_split > 1 && reflections == 0 && caustic == CausticPath::CAMERA &&
+        !fog_volume) {
+      return splitCameraRay(ray, hit_record, nee, max_split);
+    }
+    Ray scattered;
+    double t = sampleFog(ray, scattered, hit_record.t_);
+    // Camera rays show the glow around the emitters, deeper segments only
+    // blur it, not worth an equiangular sample.
+    bool equiangular = nee && fog.enabled() && !fog_volume &&
+                       reflections == 0 && Options::get().equiangular;
+    FogSegment segment;
+    Color glow(0, 0, 0);
+    if (equiangular) {
+      double length = ray.direction().len();
+      segment.ray_ = Ray(ray.origin(), ray.direction() / length);
+      segment.length_ = hit_record.t_ * length;
+      glow = sampleEquiangular(segment);
+    }
+    // Scatterred by the fog before hitting anything.
+    Color color =
+        hit_record.t_ > t
+            ? scatterFog(ray.direction().normalize(), scattered, reflections,
+                         nee, equiangular ? &segment : nullptr)
+            : shadeSurface(ray, hit_record, reflections, from, caustic, nee,
+                           max_split);
+    if (aov_sample && equiangular) aov_sample->direct_ += glow;
+    return glow + color;
+  }
 
-      if (!hit_record.material_->scatter(ray, hit_record, attenuation,
-                                         scattered)) {
+  // Light the fog scatters back against the unit direction d, from a
+  // scattering vertex at the origin of scattered and the path continuing
+  // along it. With segment, the vertex's light sample is combined with the
+  // segment's equiangular samples instead of with phase function sampling.
+  static Color scatterFog(Direction const& d, Ray const& scattered,
+                          int reflections, bool nee,
+                          FogSegment const* segment = nullptr) {
+    RoughnessScope scope(1.0);
+    if (!nee) {
+      Color incoming =
+          traceRay(scattered, reflections + 1, nullptr, CausticPath::NONE);
+      if (aov_sample) {
+        returnDirect(reflections, Color(0, 0, 0),
+                     fog.albedo_ * childDirect(reflections));
+      }
+      return fog.albedo_ * incoming;
+    }
+    Point const& x = scattered.origin();
+    if (segment) {
+      // Light sampling alone, so the scattered path ignores the emitters it
+      // hits, which a zero density tells emissionWeight().
+      ScatterVertex vertex{x, Direction(), false, 0.0};
+      Color direct(0, 0, 0);
+      if (Background::environment()) {
+        direct += sampleEnvironment(x, PhaseOnly{fog, d});
+      }
+      double select_pdf;
+      size_t index = selectLight(x, nullptr, select_pdf);
+      if (select_pdf > 0.0) {
+        double distance_pdf =
+            segment->distance_scale_ *
+            fog.density((x - segment->ray_.origin()).len()) * select_pdf;
+        double equiangular_pdf = equiangularPdf(*segment, x, index);
+        direct += sampleEmitter(x, index, select_pdf, PhaseOnly{fog, d}) *
+                  static_cast<float>(distance_pdf /
+                                     (distance_pdf + equiangular_pdf));
+      }
+      Color incoming =
+          traceRay(scattered, reflections + 1, &vertex, CausticPath::NONE);
+      if (aov_sample) {
+        returnDirect(reflections, Color(0, 0, 0),
+                     fog.albedo_ * (direct + childDirect(reflections)));
+      }
+      return fog.albedo_ * (direct + incoming);
+    }
+    ScatterVertex vertex{x, Direction(), false,
+                         fog.phase(d, scattered.direction())};
+    Color direct =
+        directLight(vertex.p_, nullptr, [&](Direction const& wi, double& pdf) {
+          pdf = fog.phase(d, wi);
+          return Color(pdf, pdf, pdf);
+        });
+    Color incoming =
+        traceRay(scattered, reflections + 1, &vertex, CausticPath::NONE);
+    if (aov_sample) {
+      returnDirect(reflections, Color(0, 0, 0),
+                   fog.albedo_ * (direct + childDirect(reflections)));
+    }
+    return fog.albedo_ * (direct + incoming);
+  }
+
+  // Light leaving the surface hit by ray toward it. The first non-specular
+  // vertex of a camera path branches into up to max_split paths; see
+  // Material::split.
+  static Color shadeSurface(Ray const& ray, HitRecord const& hit_record,
+                            int reflections, ScatterVertex const* from,
+                            CausticPath caustic, bool nee, int max_split) {
+    Material const& material = *hit_record.material_;
+    Color emitted = material.emit(hit_record);
+    if (from && material.isEmissive()) {
+      emitted *= static_cast<float>(emissionWeight(hit_record, *from));
+    }
+    if (caustic == CausticPath::IN_MAP) emitted = Color(0, 0, 0);
+
+    if (material.isSpecular()) {
+      Color attenuation;
+      Ray scattered;
+      if (!material.scatter(ray, hit_record, attenuation, scattered)) {
+        if (aov_sample) returnDirect(reflections, emitted);
         return emitted;
       }
+      if (caustic == CausticPath::GATHERED) caustic = CausticPath::IN_MAP;
+      Color incoming = traceRay(scattered, reflections + 1, nullptr, caustic);
+      if (aov_sample) {
+        returnDirect(reflections, emitted,
+                     childDirect(reflections) * attenuation);
+      }
+      return incoming * attenuation + emitted;
+    }
+    // Caustics gathered here reach the surface through specular vertices,
+    // indirect light for the AOVs.
+    Color surface_emitted = emitted;
+    bool gather = caustic_map && caustic == CausticPath::CAMERA;
+    if (gather) emitted += causticRadiance(ray, hit_record);
 
-      return traceRay(scattered, reflections + 1) * attenuation + emitted;
+    // Past the first diffuse vertex, diffuse surfaces reuse the cached
+    // radiance of their neighborhood, or add to it.
+    Point const& p = hit_record.p_;
+    bool cache = radiance_cache && material.isDiffuse() &&
+                 caustic != CausticPath::CAMERA;
+    Color albedo;
+    if (cache) {
+      albedo = material.eval(ray, hit_record, hit_record.normal_) *
+               static_cast<float>(PI);
+      Color cached;
+      if (radiance_cache->lookup(p, hit_record.normal_, albedo, cached)) {
+        if (aov_sample) returnDirect(reflections, surface_emitted);
+        return cached + emitted;
+      }
+    }
+
+    int splits =
+        caustic == CausticPath::CAMERA ? material.split(max_split) : 1;
+    Color outgoing(0, 0, 0), direct(0, 0, 0);
+    for (int i = 0; i < splits; i++) {
+      outgoing +=
+          scatterSurface(ray, hit_record, reflections, nee,
+                         gather ? CausticPath::GATHERED : CausticPath::NONE);
+      if (aov_sample) direct += aov_sample->direct_;
+    }
+    outgoing /= static_cast<float>(splits);
+    if (cache) {
+      radiance_cache->record(p, hit_record.normal_, albedo, outgoing);
     }
-    return Background::color(ray);
+    if (aov_sample) {
+      returnDirect(reflections, surface_emitted,
+                   direct / static_cast<float>(splits));
+    }
+    return outgoing + emitted;
+  }
+
+  // A camera ray shared by max_split paths. Instead of sampleFog picking the
+  // fog or the surface, both are estimated, weighted by their probability,
+  // with the paths divided between them in proportion. Fog vertices are
+  // drawn from the free-flight density restricted to the segment.
+  static Color splitCameraRay(Ray const& ray, HitRecord const& hit_record,
+                              bool nee, int max_split) {
+    double length = ray.direction().len();
+    double distance = hit_record.t_ * length;
+    double transmittance = fogTransmittance(distance);
+    Color color(0, 0, 0), direct(0, 0, 0);
+    if (transmittance > 0.0) {
+      int surface_split = std::ceil(max_split * transmittance);
+      color += shadeSurface(ray, hit_record, 0, nullptr, CausticPath::CAMERA,
+                            nee, surface_split) *
+               static_cast<float>(transmittance);
+      if (aov_sample) {
+        direct += aov_sample->direct_ * static_cast<float>(transmittance);
+      }
+    }
+    int fog_paths = std::ceil(max_split * (1.0 - transmittance));
+    Direction d = ray.direction() / length;
+    // As many equiangular samples as fog paths.
+    FogSegment segment{Ray(ray.origin(), d), distance,
+                       fog_paths / std::max(1e-12, 1.0 - transmittance),
+                       fog_paths};
+    bool equiangular = nee && fog_paths > 0 && Options::get().equiangular;
+    if (equiangular) {
+      Color glow = sampleEquiangular(segment);
+      color += glow;
+      direct += glow;
+    }
+    for (int i = 0; i < fog_paths; i++) {
+      Ray scattered(ray.at(fog.sampleDistance(distance) / length),
+                    fog.samplePhase(d));
+      float weight = (1.0 - transmittance) / fog_paths;
+      color += scatterFog(d, scattered, 0, nee,
+                          equiangular ? &segment : nullptr) *
+               weight;
+      if (aov_sample) direct += aov_sample->direct_ * weight;
+    }
+    if (aov_sample) aov_sample->direct_ = direct;
+    return color;
+  }
+
+  // Light scattered toward the origin of segment, from its equiangular
+  // samples (Kulla and Fajardo 2012): each picks an emitter by
+  // equiangularWeight(), then a distance with density proportional to the
+  // inverse squared distance to the emitter's center, which concentrates
+  // samples in the glow around it.
+  static Color sampleEquiangular(FogSegment& segment) {
+    thread_local std::vector<double> cdf;
+    cdf.resize(lights.size());
+    segment.light_weight_ = 0.0;
+    for (size_t i = 0; i < lights.size(); i++) {
+      segment.light_weight_ += equiangularWeight(segment, i);
+      cdf[i] = segment.light_weight_;
+    }
+    if (segment.light_weight_ <= 0.0) return Color(0, 0, 0);
+    Direction const& d = segment.ray_.direction();
+    Color sum(0, 0, 0);
+    for (int i = 0; i < segment.equiangular_samples_; i++) {
+      size_t index =
+          std::upper_bound(cdf.begin(), cdf.end(),
+                           rand_double() * segment.light_weight_) -
+          cdf.begin();
+      index = std::min(index, lights.size() - 1);
+      Point const& center = lights[index]->center();
+      double delta = dot(center - segment.ray_.origin(), d);
+      double h = (segment.ray_.at(delta) - center).len();
+      double theta_a = std::atan2(-delta, h);
+      double theta_b = std::atan2(segment.length_ - delta, h);
+      double s =
+          delta + h * std::tan(theta_a + rand_double() * (theta_b - theta_a));
+      Point x = segment.ray_.at(s);
+      Color light = sampleEmitter(x, index, 1.0, PhaseOnly{fog, d});
+      if (light.x() <= 0.0f && light.y() <= 0.0f && light.z() <= 0.0f) {
+        continue;
+      }
+      double distance_pdf = segment.distance_scale_ * fog.density(s) *
+                            lightPmf(x, nullptr, index);
+      double equiangular_pdf = equiangularPdf(segment, x, index);
+      // The balance heuristic over both strategies, for sigma_s * T(s).
+      sum += light * static_cast<float>(fog.albedo_ * fog.density(s) /
+                                        (distance_pdf + equiangular_pdf));
+    }
+    return sum;
+  }
+
+  // How much light of lights[index] the fog along segment scatters, up to a
+  // constant factor and ignoring occlusion and transmittance: its power
+  // times the integral of the inverse squared distance to its center.
+  static double equiangularWeight(FogSegment const& segment, size_t index) {
+    Point const& center = lights[index]->center();
+    Direction const& d = segment.ray_.direction();
+    double delta = dot(center - segment.ray_.origin(), d);
+    double h = (segment.ray_.at(delta) - center).len();
+    if (h <= 1e-9) return 0.0;
+    // The angle the segment subtends from the center, in one atan2.
+    double length = segment.length_;
+    double angle = std::atan2(length * h, h * h - delta * (length - delta));
+    return light_power.pmf(index) * angle / h;
+  }
+
+  // Density of segment's equiangular samples producing x from lights[index],
+  // over all its samples. The angles of the weight and of the distance
+  // density cancel.
+  static double equiangularPdf(FogSegment const& segment, Point const& x,
+                               size_t index) {
+    if (segment.light_weight_ <= 0.0) return 0.0;
+    double dist_squared = (x - lights[index]->center()).lenSquared();
+    return segment.equiangular_samples_ * light_power.pmf(index) /
+           (segment.light_weight_ * dist_squared);
+  }
+
+  // Light leaving a non-specular surface along ray, from one light sample
+  // and one scattered path whose vertices are in state next.
+  static Color scatterSurface(Ray const& ray, HitRecord const& hit_record,
+                              int reflections, bool nee, CausticPath next) {
+    Material const& material = *hit_record.material_;
+    RoughnessScope scope(material.roughness());
+    Point const& p = hit_record.p_;
+    Color attenuation;
+    Ray scattered;
+    bool scatters = material.scatter(ray, hit_record, attenuation, scattered);
+
+    // With a learned distribution of incident light at this point, mix it
+    // with the BSDF in a one-sample mixture.
+    SDTree::Leaf* guide_leaf = guide ? &guide->leaf(p) : nullptr;
+    DTree const* guide_tree = guide_leaf && guide_leaf->sampling_.total() > 0
+                                  ? &guide_leaf->sampling_
+                                  : nullptr;
+    double guide_fraction = guide_tree ? Options::get().guiding_fraction : 0.0;
+    auto bsdf = [&](Direction const& wi, double& pdf) {
+      pdf = material.pdf(ray, hit_record, wi);
+      if (guide_tree) {
+        pdf = guide_fraction * guide_tree->pdf(wi) +
+              (1.0 - guide_fraction) * pdf;
+      }
+      return material.eval(ray, hit_record, wi);
+    };
+    if (guide_tree && rand_double() < guide_fraction) {
+      scattered = Ray(p, guide_tree->sample());
+      scatters = true;
+    }
+    double pdf = 0.0;
+    if (scatters) {
+      Direction d = scattered.direction().normalize();
+      if (guide_tree) {
+        Color f = bsdf(d, pdf);
+        scatters = pdf > 0.0;
+        if (scatters) attenuation = f / static_cast<float>(pdf);
+      } else {
+        pdf = material.pdf(ray, hit_record, d);
+      }
+    }
+
+    bool learning = guide_leaf && guide_learning;
+    Color direct(0, 0, 0);
+    if (nee) {
+      // Light sampling doesn't depend on scatter() and counts even when
+      // the scattered ray is absorbed.
+      IncidentSample incident;
+      direct = directLight(p, &hit_record.normal_, bsdf,
+                           learning ? &incident : nullptr);
+      if (learning) {
+        guide->record(p, incident.wi_, luminance(incident.radiance_));
+      }
+    }
+    Color outgoing = direct;
+    if (scatters) {
+      ScatterVertex vertex{p, hit_record.normal_, true, pdf};
+      Color incoming =
+          traceRay(scattered, reflections + 1, nee ? &vertex : nullptr, next);
+      if (learning) {
+        guide->record(p, scattered.direction().normalize(),
+                      luminance(incoming) / pdf);
+      }
+      outgoing += incoming * attenuation;
+      if (aov_sample) direct += childDirect(reflections) * attenuation;
+    }
+    if (aov_sample) returnDirect(reflections, Color(0, 0, 0), direct);
+    return outgoing;
   }
 
-  static double randomScatter(Ray const& ray, Ray& scattered) {
-    double scatter_distance = rand_double(0.01, 25.0);
-    double t = scatter_distance / ray.direction().len();
-    scattered = Ray(ray.at(t), Direction::rand_unit_vec());
+  // Density estimate of the caustic photons around a diffuse hit, reflected
+  // back along ray.
+  static Color causticRadiance(Ray const& ray, HitRecord const& hit_record) {
+    Material const& material = *hit_record.material_;
+    double radius = Options::get().caustic_radius;
+    Color sum(0, 0, 0);
+    caustic_map->gather(hit_record.p_, radius, [&](Photon const& photon) {
+      // Only photons on the same side of the same sphere.
+      if (photon.hittable_ != hit_record.hittable_ ||
+          photon.front_face_ != hit_record.front_face_) {
+        return;
+      }
+      double cos_theta = dot(photon.wi_, hit_record.normal_);
+      if (cos_theta <= 0.0) return;
+      Color f = material.eval(ray, hit_record, photon.wi_) /
+                static_cast<float>(cos_theta);
+      sum += f * photon.power_;
+    });
+    // The part of a sphere of radius R within radius of a point on it has
+    // area PI * radius^2 while radius <= 2R, however curved, and is the
+    // whole sphere beyond.
+    double area = PI * radius * radius;
+    if (auto sphere = dynamic_cast<Sphere const*>(hit_record.hittable_)) {
+      area = std::min(area, 4.0 * PI * sphere->radius() * sphere->radius());
+    }
+    return sum / static_cast<float>(area);
+  }
+
+  // Estimate the light reaching p straight from one emissive sphere. bsdf(wi,
+  // pdf) returns the BSDF times cosine for the sampled unit direction wi and
+  // sets pdf to the density of scattering into wi. Pass the surface normal so
+  // that spheres below the horizon are picked less often.
+  // If incident is given, it receives the sampled direction and the radiance
+  // arriving from it divided by its density. An environment map is sampled
+  // too, separately, and left out of incident.
+  template <typename Bsdf>
+  static Color directLight(Point const& p, Direction const* normal,
+                           Bsdf const& bsdf,
+                           IncidentSample* incident = nullptr) {
+    if (incident) incident->radiance_ = Color(0, 0, 0);
+    Color color(0, 0, 0);
+    if (Background::environment()) color = sampleEnvironment(p, bsdf);
+    if (lights.empty()) return color;
+    double select_pdf;
+    size_t index = selectLight(p, normal, select_pdf);
+    if (select_pdf <= 0.0) return color;
+    return color + sampleEmitter(p, index, select_pdf, bsdf, incident);
+  }
+
+  // The light reaching p from the environment map along one direction
+  // sampled from it, weighted against BSDF sampling by MIS. The fog doesn't
+  // reach the environment.
+  template <typename Bsdf>
+  static Color sampleEnvironment(Point const& p, Bsdf const& bsdf) {
+    EnvironmentMap const& environment = *Background::environment();
+    double pdf;
+    Direction wi = environment.sample(pdf);
+    if (pdf <= 0.0) return Color(0, 0, 0);
+    double bsdf_pdf;
+    Color f = bsdf(wi, bsdf_pdf);
+    if (f.x() <= 0.0f && f.y() <= 0.0f && f.z() <= 0.0f) {
+      return Color(0, 0, 0);
+    }
+    if (world.occluded(Ray(p, wi), 1e-3, INF)) return Color(0, 0, 0);
+    double weight = Options::get().mis ? powerHeuristic(pdf, bsdf_pdf) : 1.0;
+    return environment.radiance(wi) * f * static_cast<float>(weight / pdf);
+  }
+
+  // Weight of the environment seen by a ray scattered from a vertex that
+  // also sampled it directly.
+  static double environmentWeight(Ray const& ray, ScatterVertex const& from) {
+    if (!Options::get().mis) return 0.0;
+    double light_pdf =
+        Background::environment()->pdf(ray.direction().normalize());
+    return powerHeuristic(from.pdf_, light_pdf);
+  }
+
+  // directLight() from the emitter lights[index], picked with probability
+  // select_pdf.
+  template <typename Bsdf>
+  static Color sampleEmitter(Point const& p, size_t index, double select_pdf,
+                             Bsdf const& bsdf,
+                             IncidentSample* incident = nullptr) {
+    Sphere const* light = lights[index];
+
+    Direction wi;
+    double pdf;
+    if (!light->sampleDirection(p, wi, pdf)) return Color(0, 0, 0);
+    double bsdf_pdf;
+    Color f = bsdf(wi, bsdf_pdf);
+    if (f.x() <= 0.0f && f.y() <= 0.0f && f.z() <= 0.0f) {
+      return Color(0, 0, 0);
+    }
+
+    Ray shadow_ray(p, wi);
+    HitRecord light_record;
+    if (!light->hit(shadow_ray, 1e-3, INF, light_record)) {
+      return Color(0, 0, 0);
+    }
+    if (world.occluded(shadow_ray, 1e-3, light_record.t_ * (1 - 1e-6))) {
+      return Color(0, 0, 0);
+    }
+    double light_pdf = pdf * select_pdf;
+    double weight =
+        Options::get().mis ? powerHeuristic(light_pdf, bsdf_pdf) : 1.0;
+    Color radiance = light->material()->emit(light_record) *
+                     static_cast<float>(
+                         weight *
+                         fogTransmittance(shadow_ray, light_record.t_) /
+                         light_pdf);
+    if (incident) *incident = IncidentSample{wi, radiance};
+    return radiance * f;
+  }
+
+  // Weight of emission found by a ray scattered from a vertex that also
+  // sampled the lights directly. Without MIS light sampling takes it all.
+  static double emissionWeight(HitRecord const& hit_record,
+                               ScatterVertex const& from) {
+    if (!Options::get().mis) return 0.0;
+    size_t index = light_index.at(hit_record.hittable_);
+    double light_pdf = lightPmf(from.p_, from.normal(), index) *
+                       lights[index]->directionPdf(from.p_);
+    return powerHeuristic(from.pdf_, light_pdf);
+  }
+
+  // Veach's power heuristic with exponent 2, weighting a sample taken with
+  // density pdf against another strategy with density other_pdf.
+  static double powerHeuristic(double pdf, double other_pdf) {
+    if (pdf <= 0.0) return 0.0;
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+  }
+
+  // Pick one emissive sphere for direct lighting at p. Return its index in
+  // lights and set pmf to the probability of picking it, 0 if none can be.
+  static size_t selectLight(Point const& p, Direction const* normal,
+                            double& pmf) {
+    switch (Options::get().light_sampler) {
+      case LightSampler::TREE:
+        return light_tree.sample(p, normal, rand_double(), pmf);
+      case LightSampler::POWER:
+        return light_power.sample(rand_double(), &pmf);
+      case LightSampler::EXHAUSTIVE:
+        break;
+    }
+    thread_local std::vector<double> cdf;
+    cdf.resize(lights.size());
+    double total = 0.0;
+    for (size_t i = 0; i < lights.size(); i++) {
+      total += exhaustiveWeight(*lights[i], p, normal);
+      cdf[i] = total;
+    }
+    pmf = 0.0;
+    if (total <= 0.0) return 0;
+    size_t index = std::upper_bound(cdf.begin(), cdf.end() - 1,
+                                    rand_double() * total) -
+                   cdf.begin();
+    pmf = (cdf[index] - (index ? cdf[index - 1] : 0.0)) / total;
+    return index;
+  }
+
+  // Probability of selectLight(p, normal) picking lights[index].
+  static double lightPmf(Point const& p, Direction const* normal,
+                         size_t index) {
+    switch (Options::get().light_sampler) {
+      case LightSampler::TREE:
+        return light_tree.pmf(p, normal, index);
+      case LightSampler::POWER:
+        return light_power.pmf(index);
+      case LightSampler::EXHAUSTIVE:
+        break;
+    }
+    double total = 0.0;
+    for (Sphere const* light : lights) {
+      total += exhaustiveWeight(*light, p, normal);
+    }
+    if (total <= 0.0) return 0.0;
+    return exhaustiveWeight(*lights[index], p, normal) / total;
+  }
+
+  // Power times the solid angle the light subtends at p, or 0 if it is
+  // entirely below the horizon of normal.
+  static double exhaustiveWeight(Sphere const& light, Point const& p,
+                                 Direction const* normal) {
+    Direction to_center = light.center() - p;
+    double dist_squared = to_center.lenSquared();
+    double radius_squared = light.radius() * light.radius();
+    double sin_max_squared = std::min(1.0, radius_squared / dist_squared);
+    double below = normal ? dot(*normal, to_center) : 0.0;
+    if (below < 0 && below * below > sin_max_squared * dist_squared) {
+      return 0.0;
+    }
+    // 1 - cos_max, proportional to the subtended solid angle.
+    return light.material()->power() * sin_max_squared /
+           (1.0 + sqrt(1.0 - sin_max_squared));
+  }
+
+  // Where the fog scatters ray, as a ray parameter, and the scattered ray.
+  // The fog fills the space between the spheres, so a ray that misses every
+  // sphere reaches the sky unscattered. Without fog, return INF at no cost.
+  // The ground fog volume is only tracked up to t_max, the sphere hit, and
+  // returns INF past it.
+  static double sampleFog(Ray const& ray, Ray& scattered,
+                          double t_max = INF) {
+    if (!fog.enabled() && !fog_volume) return INF;
+    double length = ray.direction().len();
+    Direction d = ray.direction() / length;
+    double distance;
+    if (fog_volume) {
+      double max_distance = t_max < INF ? t_max * length : INF;
+      distance = fog_volume->sampleDistance(Ray(ray.origin(), d),
+                                            max_distance);
+      if (distance == INF) return INF;
+    } else {
+      distance = fog.sampleDistance();
+    }
+    double t = distance / length;
+    scattered = Ray(ray.at(t), fog.samplePhase(d));
     return t;
   }
 
+  // Probability that the homogeneous fog leaves a segment of this length
+  // clear, as bidirectional paths see it.
+  static double fogTransmittance(double distance) {
+    return fog.transmittance(distance);
+  }
+
+  // Fraction of light that crosses the fog along ray, whose direction is a
+  // unit vector, for distance: exact in the homogeneous fog, an unbiased
+  // estimate in the ground fog volume.
+  static double fogTransmittance(Ray const& ray, double distance) {
+    if (fog_volume) return fog_volume->transmittance(ray, distance);
+    return fog.transmittance(distance);
+  }
+
+  // Density of sampleFog stopping at this distance in the homogeneous fog.
+  static double fogDensity(double distance) { return fog.density(distance); }
+
+  static HomogeneousMedium const& medium() { return fog; }
+  // The ground fog volume, null when the fog is homogeneous.
+  static VoxelVolume const* fogVolume() { return fog_volume.get(); }
+
+  // Follow ray through specular vertices to the first shading point.
+  static ShadingPoint findShadingPoint(Ray ray) {
+    ShadingPoint point;
+    for (int reflections = 0; reflections <= MAX_REFLECTION; reflections++) {
+      HitRecord& hit_record = point.hit_record_;
+      point.ray_ = ray;
+      if (!world.hit(ray, 1e-3, INF, hit_record)) {
+        point.emitted_ += point.throughput_ * Background::color(ray);
+        return point;
+      }
+      Ray scattered;
+      double t = sampleFog(ray, scattered, hit_record.t_);
+      if (hit_record.t_ > t) {
+        hit_record.p_ = scattered.origin();
+        hit_record.material_ = nullptr;
+        point.throughput_ *= fog.albedo_;
+        point.valid_ = true;
+        return point;
+      }
+      Material const& material = *hit_record.material_;
+      point.emitted_ += point.throughput_ * material.emit(hit_record);
+      if (!material.isSpecular()) {
+        point.valid_ = true;
+        return point;
+      }
+      Color attenuation;
+      if (!material.scatter(ray, hit_record, attenuation, scattered)) {
+        return point;
+      }
+      point.throughput_ = point.throughput_ * attenuation;
+      ray = scattered;
+    }
+    return point;
+  }
+
+  // Fraction of the light leaving y, such as a point on an emitter, that
+  // reaches p past the spheres and through the fog.
+  static double transmittance(Point const& p, Point const& y) {
+    if (occluded(p, y)) return 0.0;
+    Direction d = y - p;
+    double dist = d.len();
+    return fogTransmittance(Ray(p, d / dist), dist);
+  }
+
+  // Any-hit test of whether a sphere blocks the segment from p to y.
+  static bool occluded(Point const& p, Point const& y) {
+    Direction d = y - p;
+    double dist = d.len();
+    if (dist <= 1e-3) return true;
+    return world.occluded(Ray(p, d / dist), 1e-3, dist * (1 - 1e-6));
+  }
+
+  static std::vector<Sphere const*> const& emitters() { return lights; }
+
+  // Closest hit along ray, ignoring the fog.
+  static bool intersect(Ray const& ray, HitRecord& hit_record) {
+    return world.hit(ray, 1e-3, INF, hit_record);
+  }
+
+  // Pick an emitter in proportion to its power alone, independent of any
+  // receiving point, as light paths starting on the emitters need.
+  static size_t samplePowerLight(double& pmf) {
+    return light_power.sample(rand_double(), &pmf);
+  }
+  static double powerLightPmf(size_t index) { return light_power.pmf(index); }
+  static size_t lightIndex(Hittable const* hittable) {
+    return light_index.at(hittable);
+  }
+  static Aabb const& bounds() { return bounds_; }
+
+  // Guide scattering at non-specular surfaces by tree, and record the light
+  // arriving there into it while learning. Pass null to stop guiding.
+  static void setGuide(SDTree* tree, bool learning) {
+    guide = tree;
+    guide_learning = learning;
+  }
+
+  // Gather caustics from map at the first diffuse vertex of camera paths, in
+  // place of the specular paths from there to the emitters. Pass null to
+  // trace caustics as any other path.
+  static void setCaustics(PhotonMap const* map) { caustic_map = map; }
+
+  // End paths at their second diffuse vertex in cache, once it has enough
+  // records there, and record the radiance of the other paths. Pass null to
+  // trace every path to the end.
+  static void setRadianceCache(RadianceCache* cache) {
+    radiance_cache = cache;
+  }
+
+  // Record the AOVs of the camera paths traced on this thread into sample,
+  // which the caller resets before each path. Pass null to stop.
+  static void setAovSample(AovSample* sample) { aov_sample = sample; }
+
   static void addSphere(std::shared_ptr<Material> material, Point const& center,
                         double radius) {
-    world.addHittable(std::make_unique<Sphere>(center, radius, material));
+    auto sphere = std::make_unique<Sphere>(center, radius, material);
+    Direction extent(radius, radius, radius);
+    bounds_.grow(Aabb(center - extent, center + extent));
+    if (material->isEmissive()) {
+      light_index[sphere.get()] = lights.size();
+      lights.push_back(sphere.get());
+    }
+    world.addHittable(std::move(sphere));
   }
   static void init() {
+    Options const& options = Options::get();
+    fog.sigma_t_ = std::max(0.0, options.fog_density);
+    fog.albedo_ = options.fog_albedo;
+    fog.g_ = std::clamp(options.fog_anisotropy, -0.99, 0.99);
+    if (options.fog_volume) buildFogVolume();
+
     // Add ground
     addSphere(
         std::make_shared<Lambertian>(std::make_shared<CheckerTexture>(1000)),
@@ -105,12 +886,166 @@ struct World {
 
     addSphere(std::make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0),
               Point(6, 1, 0), 1.0);
+
+    if (Options::get().glass_shells) {
+      std::vector<Sphere const*> emitters = lights;
+      for (Sphere const* light : emitters) {
+        addSphere(std::make_shared<Dielectric>(1.5), light->center(),
+                  1.25 * light->radius());
+      }
+    }
+
+    buildLightSamplers();
+  }
+
+  static void buildLightSamplers() {
+    light_tree.build(lights);
+    std::vector<double> powers;
+    for (Sphere const* light : lights) {
+      powers.push_back(LightBounds::ofSphere(*light).power_);
+    }
+    light_power.build(powers);
+  }
+
+  // Ground fog over the field of small spheres, decaying exponentially with
+  // height and modulated by three octaves of value noise into banks and
+  // gaps.
+  static void buildFogVolume() {
+    Options const& options = Options::get();
+    double height = std::max(1e-3, options.fog_volume_height);
+    Aabb box(Point(-13, 0, -13), Point(13, 6 * height, 13));
+    int n = std::max(1, options.fog_volume_resolution);
+    int ny = std::max(1, static_cast<int>(std::ceil(n * 6 * height / 26)));
+    fog_volume = std::make_unique<VoxelVolume>(
+        box, n, ny, n,
+        [&](Point const& p) {
+          double noise = 0.0;
+          for (int octave = 0; octave < 3; octave++) {
+            double scale = 0.5 * (1 << octave);
+            noise += valueNoise(Point(p.x() * scale, p.y() * scale * 2,
+                                      p.z() * scale)) /
+                     (1 << octave);
+          }
+          // noise / 1.75 is in [0, 1).
+          return options.fog_volume_density * std::exp(-p.y() / height) *
+                 std::max(0.0, 2.0 * noise / 1.75 - 0.3);
+        },
+        options.fog_volume_step);
   }
 
  private:
+  // Texture::getColorAtLevel level for a hit after reflections bounces, see
+  // Options::shading_lod.
+  static int textureLevel(int reflections) {
+    Options const& options = Options::get();
+    if (!options.shading_lod) return 0;
+    if (reflections >= options.lod_average_depth ||
+        path_roughness >= options.lod_roughness) {
+      return Texture::AVERAGE_LEVEL;
+    }
+    return reflections >= options.lod_mip_depth ? options.lod_mip_level : 0;
+  }
+
+  // Adds to the roughness of the path being traced on this thread while a
+  // vertex's scattered path is traced.
+  class RoughnessScope {
+   public:
+    explicit RoughnessScope(double roughness) : saved_(path_roughness) {
+      path_roughness += roughness;
+    }
+    ~RoughnessScope() { path_roughness = saved_; }
+
+   private:
+    double saved_;
+  };
+
+  // The first-hit AOVs of a camera path.
+  static void recordFirstHit(Ray const& ray, HitRecord const& hit_record) {
+    aov_sample->normal_ = hit_record.normal_;
+    aov_sample->albedo_ = hit_record.material_->albedo(hit_record);
+    aov_sample->depth_ = hit_record.t_ * ray.direction().len();
+    aov_sample->material_id_ = hit_record.material_->id();
+  }
+
+  // AovSample::direct_ passes the direct part of what a call returns back to
+  // its caller. At depth 1 that is the light emitted at the vertex, at depth
+  // 0 also what it gathers from depth 1 and light samples, lit; deeper calls
+  // leave it alone.
+  static void returnDirect(int reflections, Color const& emitted,
+                           Color const& lit = Color(0, 0, 0)) {
+    if (reflections == 0) {
+      aov_sample->direct_ = emitted + lit;
+    } else if (reflections == 1) {
+      aov_sample->direct_ = emitted;
+    }
+  }
+  // The direct part of what the last call at reflections + 1 returned.
+  static Color childDirect(int reflections) {
+    return reflections == 0 ? aov_sample->direct_ : Color(0, 0, 0);
+  }
+
+  // Smoothly interpolated pseudorandom values in [0, 1) at integer points.
+  static double valueNoise(Point const& p) {
+    int ix = std::floor(p.x()), iy = std::floor(p.y()), iz = std::floor(p.z());
+    auto smooth = [](double u) { return u * u * (3.0 - 2.0 * u); };
+    double u = smooth(p.x() - ix), v = smooth(p.y() - iy),
+           w = smooth(p.z() - iz);
+    auto lattice = [&](int dx, int dy, int dz) {
+      uint32_t h = static_cast<uint32_t>(ix + dx) * 73856093u ^
+                   static_cast<uint32_t>(iy + dy) * 19349663u ^
+                   static_cast<uint32_t>(iz + dz) * 83492791u;
+      h ^= h >> 13;
+      h *= 0x5bd1e995u;
+      h ^= h >> 15;
+      return (h & 0xffffff) / double(1 << 24);
+    };
+    auto lerp = [](double a, double b, double t) { return a + (b - a) * t; };
+    return lerp(
+        lerp(lerp(lattice(0, 0, 0), lattice(1, 0, 0), u),
+             lerp(lattice(0, 1, 0), lattice(1, 1, 0), u), v),
+        lerp(lerp(lattice(0, 0, 1), lattice(1, 0, 1), u),
+             lerp(lattice(0, 1, 1), lattice(1, 1, 1), u), v),
+        w);
+  }
+
   static HittableList world;
+  static std::vector<Sphere const*> lights;
+  static std::unordered_map<Hittable const*, size_t> light_index;
+  static LightTree light_tree;
+  static AliasTable light_power;
+  static Aabb bounds_;
+  static SDTree* guide;
+  static bool guide_learning;
+  static PhotonMap const* caustic_map;
+  static RadianceCache* radiance_cache;
+  static HomogeneousMedium fog;
+  static std::unique_ptr<VoxelVolume> fog_volume;
+  static thread_local double path_roughness;
+  static thread_local AovSample* aov_sample;
 };
 
+inline Color ShadingPoint::eval(Direction const& wi, double& pdf) const {
+  if (!hit_record_.material_) {
+    pdf = World::medium().phase(ray_.direction().normalize(), wi);
+    return Color(1, 1, 1) * static_cast<float>(pdf);
+  }
+  pdf = hit_record_.material_->pdf(ray_, hit_record_, wi);
+  return hit_record_.material_->eval(ray_, hit_record_, wi);
+}
+
 HittableList World::world;
+std::vector<Sphere const*> World::lights;
+std::unordered_map<Hittable const*, size_t> World::light_index;
+LightTree World::light_tree;
+AliasTable World::light_power;
+Aabb World::bounds_;
+SDTree* World::guide = nullptr;
+bool World::guide_learning = false;
+PhotonMap const* World::caustic_map = nullptr;
+RadianceCache* World::radiance_cache = nullptr;
+HomogeneousMedium World::fog;
+std::unique_ptr<VoxelVolume> World::fog_volume;
+thread_local double World::path_roughness = 0.0;
+thread_local AovSample* World::aov_sample = nullptr;
 
 #endif
\ No newline at end of file